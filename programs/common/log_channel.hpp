@@ -0,0 +1,101 @@
+#pragma once
+#include <api.hpp>
+#include <cstdarg>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Buffered program output. Each write to stdout is a system call through the
+// emulator, so text is collected here and written in one go when the buffer
+// reaches its threshold, when flush() is called, or at the end of an API call.
+// Output can also be routed to Godot's print(), one call per flush.
+struct LogChannel {
+	static constexpr size_t CAPACITY = 16384;
+
+	void write(std::string_view text) {
+		if (m_size + text.size() > m_threshold)
+			flush();
+		if (text.size() > CAPACITY) {
+			emit(text);
+			return;
+		}
+		memcpy(m_buffer + m_size, text.data(), text.size());
+		m_size += text.size();
+		if (m_size >= m_threshold)
+			flush();
+	}
+
+	__attribute__((format(printf, 2, 3)))
+	void printf(const char *format, ...) {
+		char buffer[1024];
+		va_list args;
+		va_start(args, format);
+		const int len = vsnprintf(buffer, sizeof(buffer), format, args);
+		va_end(args);
+		if (len <= 0)
+			return;
+		if (size_t(len) < sizeof(buffer)) {
+			write(std::string_view(buffer, len));
+			return;
+		}
+		std::string text(len, '\0');
+		va_start(args, format);
+		vsnprintf(text.data(), text.size() + 1, format, args);
+		va_end(args);
+		write(text);
+	}
+
+	void flush() {
+		if (m_size == 0)
+			return;
+		const size_t size = m_size;
+		m_size = 0;
+		emit(std::string_view(m_buffer, size));
+	}
+
+	// A threshold of 0 writes through on every call
+	void set_threshold(size_t threshold) {
+		m_threshold = std::min(threshold, CAPACITY);
+		if (m_size >= m_threshold)
+			flush();
+	}
+	size_t threshold() const { return m_threshold; }
+
+	void set_to_godot(bool to_godot) {
+		flush();
+		m_to_godot = to_godot;
+	}
+	bool to_godot() const { return m_to_godot; }
+
+	size_t flushes() const { return m_flushes; }
+
+private:
+	void emit(std::string_view text) {
+		m_flushes++;
+		if (m_to_godot) {
+			// Godot's print() ends the line itself
+			if (!text.empty() && text.back() == '\n')
+				text.remove_suffix(1);
+			print(String(text));
+		} else {
+			fwrite(text.data(), 1, text.size(), stdout);
+			fflush(stdout);
+		}
+	}
+
+	char m_buffer[CAPACITY];
+	size_t m_size = 0;
+	size_t m_threshold = 4096;
+	size_t m_flushes = 0;
+	bool m_to_godot = false;
+};
+
+// One channel per program
+inline LogChannel log_channel;
+
+// Flushes the channel when an API call returns
+struct LogFlushGuard {
+	~LogFlushGuard() { log_channel.flush(); }
+};
@@ -1,25 +1,114 @@
 #include <libtcc.h>
 #include <api.hpp>
+#include "log_channel.hpp"
+#include <algorithm>
 #include <cstdarg>
 #include <cstring>
+#include <list>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 EXTERN_SYSCALL(void, sys_vstore, unsigned, const void *, size_t);
 EXTERN_SYSCALL(void, sys_vfetch, unsigned, void *, int);
 
 #define VERBOSE_COMPILE 0
 
-static TCCState *ctx;
-static Variant do_compile(const std::string &source_code, const std::string &entry) {
+// Bytes currently allocated by all TCC states, including relocated code.
+// Each block carries its size in a header, as the realloc hook is not told
+// the old size.
+static size_t tcc_heap_bytes = 0;
+static constexpr size_t TCC_BLOCK_HEADER = 16; // Keeps 16-byte alignment
+
+static void *tcc_tracking_realloc(void *ptr, unsigned long size) {
+	char *block = nullptr;
+	if (ptr != nullptr) {
+		block = (char *)ptr - TCC_BLOCK_HEADER;
+		tcc_heap_bytes -= *(size_t *)block;
+	}
+	if (size == 0) {
+		free(block);
+		return nullptr;
+	}
+	block = (char *)realloc(block, size + TCC_BLOCK_HEADER);
+	if (block == nullptr)
+		return nullptr;
+	*(size_t *)block = size;
+	tcc_heap_bytes += size;
+	return block + TCC_BLOCK_HEADER;
+}
+
+// Compiled sources. Each entry owns its TCCState, which also owns the
+// relocated code, so evicting an entry frees both. Callables never point into
+// a module: they look up their function again, and compile the source again
+// when it was evicted. Nothing is evicted while compiled code is running.
+struct CompiledModule {
+	std::string source;
+	TCCState *state;
+	size_t bytes; // Heap used by the state after relocation
+};
+static std::list<CompiledModule> module_lru; // Most recently used first
+// Keyed by the source of the entry itself, which a std::list keeps in place
+static std::unordered_map<std::string_view, std::list<CompiledModule>::iterator> module_map;
+static size_t module_budget = 16u << 20;
+static size_t module_bytes = 0;
+static struct {
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+	uint64_t errors = 0;
+} module_stats;
+static int compiled_calls = 0; // Calls into compiled code in progress
+
+static uint64_t fnv1a(const std::string &s) {
+	uint64_t hash = 14695981039346656037ull;
+	for (const unsigned char c : s) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static void compiled_functions_invalidate(const TCCState *state);
+static void module_erase(std::list<CompiledModule>::iterator it) {
+	compiled_functions_invalidate(it->state);
+	tcc_delete(it->state);
+	module_bytes -= it->bytes;
+	module_map.erase(it->source);
+	module_lru.erase(it);
+}
+
+// Evict least recently used modules until `incoming` more bytes fit. The most
+// recent module is kept even when it alone is over the budget. Eviction waits
+// until no compiled code is running, as it may be running from any module.
+static void module_cache_evict(size_t incoming) {
+	if (compiled_calls > 0)
+		return;
+	while (module_lru.size() > 1 && module_bytes + incoming > module_budget) {
+		module_erase(std::prev(module_lru.end()));
+		module_stats.evictions++;
+	}
+}
+
+// Evict every module. Nothing can be running from them.
+static void module_cache_clear() {
+	while (!module_lru.empty()) {
+		module_erase(std::prev(module_lru.end()));
+		module_stats.evictions++;
+	}
+}
+
+// Compile and relocate C code. Returns nullptr on failure.
+static TCCState *do_compile(const std::string &source_code) {
 #if VERBOSE_COMPILE
-	printf("Compiling C code: %s\n", source_code.c_str());
-	fflush(stdout);
+	log_channel.printf("Compiling C code: %s\n", source_code.c_str());
 #endif
 
 	// Create a new TCC context
-	ctx = tcc_new();
+	TCCState *ctx = tcc_new();
 	if (!ctx) {
-		fprintf(stderr, "Failed to create TCC context\n");
-		fflush(stdout);
-		return Nil;
+		log_channel.printf("Failed to create TCC context\n");
+		return nullptr;
 	}
 
 	// Set the output type to memory
@@ -37,23 +126,22 @@ static Variant do_compile(const std::string &source_code, const std::string &ent
 	tcc_add_symbol(ctx, "sys_vstore", (void *)sys_vstore);
 	tcc_add_symbol(ctx, "sys_vfetch", (void *)sys_vfetch);
 
-	// Debugging API
+	// Debugging API, buffered in the log channel
 	// clang-format off
 	tcc_add_symbol(ctx, "print_int", (void *)(void(*)(int))[](int i) {
-		printf("Int: %d", i);
-		fflush(stdout);
+		log_channel.printf("Int: %d", i);
 	});
 	tcc_add_symbol(ctx, "print_float", (void *)(void(*)(float))[](float f) {
-		printf("Float: %f", f);
-		fflush(stdout);
+		log_channel.printf("Float: %f", f);
 	});
 	tcc_add_symbol(ctx, "print_string", (void *)(void(*)(const char*))[](const char *s) {
-		printf("String: %s", s);
-		fflush(stdout);
+		log_channel.printf("String: %s", s);
 	});
 	tcc_add_symbol(ctx, "print_ptr", (void *)(void(*)(void*))[](void *p) {
-		printf("Pointer: %p", p);
-		fflush(stdout);
+		log_channel.printf("Pointer: %p", p);
+	});
+	tcc_add_symbol(ctx, "flush_output", (void *)(void(*)())[]() {
+		log_channel.flush();
 	});
 	// clang-format on
 
@@ -65,6 +153,7 @@ static Variant do_compile(const std::string &source_code, const std::string &ent
 	extern void print_float(float);
 	extern void print_string(const char*);
 	extern void print_ptr(void*);
+	extern void flush_output(void);
 	extern void *malloc(unsigned long);
 	extern void free(void*);
 	struct Variant {
@@ -81,51 +170,686 @@ static Variant do_compile(const std::string &source_code, const std::string &ent
 
 	// Compile the code
 	if (tcc_compile_string(ctx, code.c_str()) == -1) {
-		fprintf(stderr, "Failed to compile code\n");
-		fflush(stdout);
-		return Nil;
+		log_channel.printf("Failed to compile code\n");
+		tcc_delete(ctx);
+		return nullptr;
 	}
 
 	// Link the code
 	if (tcc_relocate(ctx) < 0) {
-		fprintf(stderr, "Failed to link code\n");
-		fflush(stdout);
-		return Nil;
+		log_channel.printf("Failed to link code\n");
+		tcc_delete(ctx);
+		return nullptr;
 	}
 
 #if VERBOSE_COMPILE
-	printf("Code compiled successfully\n");
-	fflush(stdout);
+	log_channel.printf("Code compiled successfully\n");
 #endif
+	return ctx;
+}
+
+// Find the compiled state for a source, compiling it on a miss
+static TCCState *compiled_state(const std::string &source_code) {
+	auto it = module_map.find(source_code);
+	if (it != module_map.end()) {
+		module_stats.hits++;
+		module_lru.splice(module_lru.begin(), module_lru, it->second);
+		return it->second->state;
+	}
+	module_stats.misses++;
+
+	const size_t heap_before = tcc_heap_bytes;
+	TCCState *state = do_compile(source_code);
+	if (state == nullptr) {
+		module_stats.errors++;
+		return nullptr;
+	}
+	const size_t bytes = tcc_heap_bytes - heap_before + source_code.size();
+	module_cache_evict(bytes);
+	module_lru.push_front(CompiledModule{ source_code, state, bytes });
+	module_map.emplace(module_lru.front().source, module_lru.begin());
+	module_bytes += bytes;
+	return state;
+}
+
+// Functions handed out as Callables. Godot calls a C++ trampoline with the
+// function handle bound as the last argument, which finds the function again
+// when its module was evicted. The table is bounded: when it is full, the slot
+// of a function whose module was evicted is reused first. A handle carries
+// the generation of its slot, so a Callable whose slot was reused reports that
+// its function was released instead of calling another one.
+//
+// Typed functions: a signature such as "float(float, float)" or
+// "void(PackedFloat32Array)" makes compile_typed() generate a C wrapper with one
+// fixed prototype, which calls the entry with its real C types. Integers and
+// floats are passed as int64 and double, and packed arrays as a pointer and
+// an element count, so arguments are converted without any system calls,
+// except for fetching packed arrays. Untyped functions take no arguments and
+// return a Variant.
+enum class CType : uint8_t {
+	Void,
+	Bool,
+	Int,
+	Float,
+	PackedByte,
+	PackedInt32,
+	PackedInt64,
+	PackedFloat32,
+	PackedFloat64,
+};
+static constexpr int TYPED_MAX_ARGS = 6;
+typedef void (*typed_wrapper_t)(const int64_t *ints, const double *floats, void *const *pointers,
+		const int64_t *lengths, void *ret);
+
+struct CompiledFunction {
+	std::shared_ptr<const std::string> source; // Including the generated wrappers
+	std::string symbol; // The wrapper of a typed function, or the entry
+	bool typed;
+	CType ret;
+	std::vector<CType> args;
+	TCCState *state = nullptr; // nullptr when evicted
+	void *address = nullptr;
+	uint32_t generation = 0;
+};
+static std::vector<CompiledFunction> compiled_functions;
+static std::unordered_map<uint64_t, size_t> compiled_function_ids; // Hash of symbol and source -> index
+static size_t compiled_functions_max = 4096;
+static size_t compiled_functions_reuse = 0; // Where to look for a slot to reuse
+
+// The function a handle refers to, or nullptr when its slot was reused
+static CompiledFunction *compiled_function_get(const Variant &handle) {
+	const int64_t value = handle;
+	const size_t slot = size_t(value & 0xFFFFFFFF);
+	if (slot < compiled_functions.size() && compiled_functions[slot].generation == uint32_t(value >> 32))
+		return &compiled_functions[slot];
+	log_channel.printf("Compiled function was released, compile it again\n");
+	return nullptr;
+}
+
+static void compiled_functions_invalidate(const TCCState *state) {
+	for (CompiledFunction &fn : compiled_functions) {
+		if (fn.state == state) {
+			fn.state = nullptr;
+			fn.address = nullptr;
+		}
+	}
+}
 
-	// Get the entry function address
-	Variant (*fun_addr)() = NULL;
-	fun_addr = (Variant(*)())tcc_get_symbol(ctx, entry.c_str());
-	if (!fun_addr) {
-		fprintf(stderr, "Function %s not found\n", entry.c_str());
-		fflush(stdout);
+// Counts a call into compiled code, and flushes its output when it returns
+struct CompiledCallGuard {
+	LogFlushGuard flush_guard;
+	CompiledCallGuard() { compiled_calls++; }
+	~CompiledCallGuard() { compiled_calls--; }
+};
+
+static bool parse_ctype(std::string_view name, CType &type) {
+	static const struct {
+		std::string_view name;
+		CType type;
+	} types[] = {
+		{ "void", CType::Void },
+		{ "bool", CType::Bool },
+		{ "int", CType::Int },
+		{ "int64_t", CType::Int },
+		{ "float", CType::Float },
+		{ "double", CType::Float },
+		{ "PackedByteArray", CType::PackedByte },
+		{ "PackedInt32Array", CType::PackedInt32 },
+		{ "PackedInt64Array", CType::PackedInt64 },
+		{ "PackedFloat32Array", CType::PackedFloat32 },
+		{ "PackedFloat64Array", CType::PackedFloat64 },
+	};
+	while (!name.empty() && name.front() == ' ')
+		name.remove_prefix(1);
+	while (!name.empty() && name.back() == ' ')
+		name.remove_suffix(1);
+	for (const auto &t : types) {
+		if (t.name == name) {
+			type = t.type;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Parse "ret(arg, arg, ...)". Returns false if the signature is invalid.
+static bool parse_signature(std::string_view signature, CType &ret, std::vector<CType> &args) {
+	const size_t open = signature.find('(');
+	if (open == std::string_view::npos || signature.back() != ')')
+		return false;
+	if (!parse_ctype(signature.substr(0, open), ret) || ret > CType::Float)
+		return false;
+	std::string_view list = signature.substr(open + 1, signature.size() - open - 2);
+	if (list.find_first_not_of(' ') == std::string_view::npos || list == "void")
+		return true;
+	while (true) {
+		const size_t comma = list.find(',');
+		CType type;
+		if (!parse_ctype(list.substr(0, comma), type) || type == CType::Void)
+			return false;
+		args.push_back(type);
+		if (comma == std::string_view::npos)
+			break;
+		list.remove_prefix(comma + 1);
+	}
+	return args.size() <= TYPED_MAX_ARGS;
+}
+
+static bool is_identifier(const std::string &name) {
+	if (name.empty() || (name[0] >= '0' && name[0] <= '9'))
+		return false;
+	for (const char c : name) {
+		if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+			return false;
+	}
+	return true;
+}
+
+// The C wrapper for an entry, appended to the source
+static std::string generate_wrapper(const std::string &entry, const std::string &wrapper_name, CType ret,
+		const std::vector<CType> &args) {
+	std::string code = "\nvoid " + wrapper_name +
+			"(const long long *i, const double *f, void *const *p, const long long *n, void *ret) {\n\t";
+	if (ret == CType::Float)
+		code += "*(double *)ret = ";
+	else if (ret != CType::Void)
+		code += "*(long long *)ret = ";
+	code += entry + "(";
+	int ints = 0, floats = 0, packed = 0;
+	for (size_t a = 0; a < args.size(); a++) {
+		if (a > 0)
+			code += ", ";
+		switch (args[a]) {
+			case CType::Bool:
+			case CType::Int:
+				code += "i[" + std::to_string(ints++) + "]";
+				break;
+			case CType::Float:
+				code += "f[" + std::to_string(floats++) + "]";
+				break;
+			default:
+				code += "p[" + std::to_string(packed) + "], n[" + std::to_string(packed) + "]";
+				packed++;
+				break;
+		}
+	}
+	code += ");\n}\n";
+	return code;
+}
+
+// Look up the function, compiling the source again if it was evicted
+static bool compiled_function_resolve(CompiledFunction &fn) {
+	fn.state = compiled_state(*fn.source);
+	if (fn.state == nullptr)
+		return false;
+	fn.address = tcc_get_symbol(fn.state, fn.symbol.c_str());
+	if (fn.address == nullptr) {
+		log_channel.printf("Function %s not found\n", fn.symbol.c_str());
+		return false;
+	}
+	return true;
+}
+
+template <typename T>
+static void *fetch_packed(const Variant &value, std::vector<uint8_t> &storage, int64_t &length) {
+	const std::vector<T> values = PackedArray<T>(value).fetch();
+	storage.resize(values.size() * sizeof(T));
+	memcpy(storage.data(), values.data(), storage.size());
+	length = values.size();
+	return storage.data();
+}
+
+static double variant_to_double(const Variant &value) {
+	switch (value.get_type()) {
+		case Variant::BOOL:
+			return bool(value) ? 1.0 : 0.0;
+		case Variant::INT:
+			return double(int64_t(value));
+		case Variant::FLOAT:
+			return double(value);
+		default:
+			return 0.0;
+	}
+}
+
+static Variant typed_call(const Variant &handle, const Variant *args, int nargs) {
+	CompiledCallGuard call_guard;
+	CompiledFunction *function = compiled_function_get(handle);
+	if (function == nullptr)
+		return Nil;
+	CompiledFunction &fn = *function;
+	if (size_t(nargs) != fn.args.size()) {
+		log_channel.printf("Typed function called with %d arguments, expected %d\n", nargs, int(fn.args.size()));
 		return Nil;
 	}
+	if (fn.address == nullptr && !compiled_function_resolve(fn))
+		return Nil;
 
-#if VERBOSE_COMPILE
-	printf("Function %s found, address %p\n", entry.c_str(), fun_addr);
-	fflush(stdout);
-#endif
+	int64_t ints[TYPED_MAX_ARGS], lengths[TYPED_MAX_ARGS];
+	double floats[TYPED_MAX_ARGS];
+	void *pointers[TYPED_MAX_ARGS];
+	std::vector<uint8_t> storage[TYPED_MAX_ARGS];
+	int n_ints = 0, n_floats = 0, n_packed = 0;
+	for (int a = 0; a < nargs; a++) {
+		const Variant &arg = args[a];
+		switch (fn.args[a]) {
+			case CType::Bool:
+			case CType::Int:
+				ints[n_ints++] = arg.get_type() == Variant::INT ? int64_t(arg) : int64_t(variant_to_double(arg));
+				break;
+			case CType::Float:
+				floats[n_floats++] = variant_to_double(arg);
+				break;
+			case CType::PackedByte:
+				pointers[n_packed] = fetch_packed<uint8_t>(arg, storage[n_packed], lengths[n_packed]);
+				n_packed++;
+				break;
+			case CType::PackedInt32:
+				pointers[n_packed] = fetch_packed<int32_t>(arg, storage[n_packed], lengths[n_packed]);
+				n_packed++;
+				break;
+			case CType::PackedInt64:
+				pointers[n_packed] = fetch_packed<int64_t>(arg, storage[n_packed], lengths[n_packed]);
+				n_packed++;
+				break;
+			case CType::PackedFloat32:
+				pointers[n_packed] = fetch_packed<float>(arg, storage[n_packed], lengths[n_packed]);
+				n_packed++;
+				break;
+			case CType::PackedFloat64:
+				pointers[n_packed] = fetch_packed<double>(arg, storage[n_packed], lengths[n_packed]);
+				n_packed++;
+				break;
+			case CType::Void:
+				break;
+		}
+	}
 
-	// Return a callable function
-	return Callable::Create<Variant()>(fun_addr);
+	union {
+		int64_t i;
+		double f;
+	} ret;
+	((typed_wrapper_t)fn.address)(ints, floats, pointers, lengths, &ret);
+	switch (fn.ret) {
+		case CType::Bool:
+			return ret.i != 0;
+		case CType::Int:
+			return ret.i;
+		case CType::Float:
+			return ret.f;
+		default:
+			return Nil;
+	}
+}
+
+static Variant untyped_trampoline(Variant handle) {
+	CompiledCallGuard call_guard;
+	CompiledFunction *fn = compiled_function_get(handle);
+	if (fn == nullptr || (fn->address == nullptr && !compiled_function_resolve(*fn)))
+		return Nil;
+	return ((Variant(*)())fn->address)();
+}
+
+// One trampoline per arity. The function handle is bound as the last argument.
+static Variant typed_trampoline_0(Variant id) {
+	return typed_call(id, nullptr, 0);
+}
+static Variant typed_trampoline_1(Variant a0, Variant id) {
+	const Variant args[] = { a0 };
+	return typed_call(id, args, 1);
+}
+static Variant typed_trampoline_2(Variant a0, Variant a1, Variant id) {
+	const Variant args[] = { a0, a1 };
+	return typed_call(id, args, 2);
+}
+static Variant typed_trampoline_3(Variant a0, Variant a1, Variant a2, Variant id) {
+	const Variant args[] = { a0, a1, a2 };
+	return typed_call(id, args, 3);
+}
+static Variant typed_trampoline_4(Variant a0, Variant a1, Variant a2, Variant a3, Variant id) {
+	const Variant args[] = { a0, a1, a2, a3 };
+	return typed_call(id, args, 4);
+}
+static Variant typed_trampoline_5(Variant a0, Variant a1, Variant a2, Variant a3, Variant a4, Variant id) {
+	const Variant args[] = { a0, a1, a2, a3, a4 };
+	return typed_call(id, args, 5);
+}
+static Variant typed_trampoline_6(Variant a0, Variant a1, Variant a2, Variant a3, Variant a4, Variant a5, Variant id) {
+	const Variant args[] = { a0, a1, a2, a3, a4, a5 };
+	return typed_call(id, args, 6);
+}
+
+static Variant typed_trampoline_for(size_t arity) {
+	switch (arity) {
+		case 0:
+			return Callable::Create<Variant(Variant)>(typed_trampoline_0);
+		case 1:
+			return Callable::Create<Variant(Variant, Variant)>(typed_trampoline_1);
+		case 2:
+			return Callable::Create<Variant(Variant, Variant, Variant)>(typed_trampoline_2);
+		case 3:
+			return Callable::Create<Variant(Variant, Variant, Variant, Variant)>(typed_trampoline_3);
+		case 4:
+			return Callable::Create<Variant(Variant, Variant, Variant, Variant, Variant)>(typed_trampoline_4);
+		case 5:
+			return Callable::Create<Variant(Variant, Variant, Variant, Variant, Variant, Variant)>(typed_trampoline_5);
+		default:
+			return Callable::Create<Variant(Variant, Variant, Variant, Variant, Variant, Variant, Variant)>(
+					typed_trampoline_6);
+	}
+}
+
+struct TypedExport {
+	std::string entry;
+	CType ret;
+	std::vector<CType> args;
+};
+
+static bool parse_export(const std::string &entry, const std::string &signature, TypedExport &result) {
+	result.entry = entry;
+	if (!is_identifier(entry) || !parse_signature(signature, result.ret, result.args)) {
+		log_channel.printf("Invalid signature '%s' for %s\n", signature.c_str(), entry.c_str());
+		return false;
+	}
+	return true;
+}
+
+static std::string wrapper_name_for(const std::string &entry) {
+	return "__typed_" + entry;
+}
+
+// Find a slot for a new function. When the table is full, the slot of a
+// function whose module was evicted is reused, or else the next one in turn.
+static size_t compiled_function_slot() {
+	if (compiled_functions.size() < compiled_functions_max) {
+		compiled_functions.emplace_back();
+		return compiled_functions.size() - 1;
+	}
+	size_t slot = compiled_functions_reuse % compiled_functions.size();
+	for (size_t i = 0; i < compiled_functions.size(); i++) {
+		const size_t candidate = (compiled_functions_reuse + i) % compiled_functions.size();
+		if (compiled_functions[candidate].state == nullptr) {
+			slot = candidate;
+			break;
+		}
+	}
+	compiled_functions_reuse = slot + 1;
+	const CompiledFunction &old = compiled_functions[slot];
+	auto it = compiled_function_ids.find(fnv1a(old.symbol + '\0' + *old.source));
+	if (it != compiled_function_ids.end() && it->second == slot)
+		compiled_function_ids.erase(it);
+	return slot;
+}
+
+// Return the handle of a function in the given source, or -1 on failure
+static int64_t function_handle(const std::shared_ptr<const std::string> &source, CompiledFunction &&function) {
+	const uint64_t hash = fnv1a(function.symbol + '\0' + *source);
+	auto it = compiled_function_ids.find(hash);
+	size_t slot;
+	if (it != compiled_function_ids.end() && compiled_functions[it->second].symbol == function.symbol &&
+			*compiled_functions[it->second].source == *source) {
+		slot = it->second;
+	} else {
+		slot = compiled_function_slot();
+		function.source = source;
+		function.generation = compiled_functions[slot].generation + 1;
+		compiled_functions[slot] = std::move(function);
+		compiled_function_ids[hash] = slot;
+	}
+	CompiledFunction &fn = compiled_functions[slot];
+	if (fn.address == nullptr && !compiled_function_resolve(fn))
+		return -1;
+	return int64_t(slot) | int64_t(fn.generation) << 32;
+}
+
+static int64_t typed_handle(const std::shared_ptr<const std::string> &source, TypedExport &&e) {
+	return function_handle(source,
+			CompiledFunction{ nullptr, wrapper_name_for(e.entry), true, e.ret, std::move(e.args) });
+}
+
+static int64_t untyped_handle(const std::shared_ptr<const std::string> &source, const std::string &entry) {
+	return function_handle(source, CompiledFunction{ nullptr, entry, false, CType::Void, {} });
+}
+
+// Return a Callable bound to a function handle
+static Variant function_callable(int64_t handle) {
+	if (handle < 0)
+		return Nil;
+	const CompiledFunction &fn = compiled_functions[size_t(handle & 0xFFFFFFFF)];
+	Variant callable = fn.typed ? typed_trampoline_for(fn.args.size())
+								: Callable::Create<Variant(Variant)>(untyped_trampoline);
+	Variant bound;
+	const Variant handle_variant = handle;
+	callable.callp("bind", &handle_variant, 1, bound);
+	return bound;
 }
 
 static Variant compile(String code, String entry) {
+	LogFlushGuard flush_guard;
 	const std::string utf = code.utf8();
 	const std::string entry_utf = entry.utf8();
 
-	return do_compile(utf, entry);
+	// Return a callable function
+	return function_callable(untyped_handle(std::make_shared<const std::string>(utf), entry_utf));
+}
+
+// Compile an entry with a signature and return a Callable bound to it
+static Variant compile_typed(String code, String entry, String signature) {
+	LogFlushGuard flush_guard;
+	TypedExport e;
+	if (!parse_export(entry.utf8(), signature.utf8(), e))
+		return Nil;
+	auto source = std::make_shared<const std::string>(
+			code.utf8() + generate_wrapper(e.entry, wrapper_name_for(e.entry), e.ret, e.args));
+	return function_callable(typed_handle(source, std::move(e)));
+}
+
+// Compile a source once and return a Dictionary with a Callable for each
+// export. `exports` is an Array of names, or a Dictionary of names and
+// signatures, where an empty signature is an untyped Variant() function.
+// All exports share the module, and compile it again together if evicted.
+static Variant compile_module(String code, Variant exports) {
+	LogFlushGuard flush_guard;
+	std::vector<std::pair<std::string, std::string>> names; // Name, signature
+	if (exports.get_type() == Variant::DICTIONARY) {
+		Dictionary dict = exports.as_dictionary();
+		Array keys = dict.keys();
+		for (int i = 0; i < keys.size(); i++) {
+			const Variant key = keys[i].get();
+			names.emplace_back(key.as_std_string(), dict[key].value().as_std_string());
+		}
+	} else if (exports.get_type() == Variant::ARRAY) {
+		Array list = exports.as_array();
+		for (int i = 0; i < list.size(); i++) {
+			names.emplace_back(list[i].get().as_std_string(), std::string());
+		}
+	} else {
+		log_channel.printf("compile_module: exports must be an Array or a Dictionary\n");
+		return Nil;
+	}
+
+	// All wrappers are appended to the one source
+	std::string source = code.utf8();
+	std::vector<TypedExport> typed;
+	for (const auto &[name, signature] : names) {
+		if (signature.empty())
+			continue;
+		TypedExport e;
+		if (!parse_export(name, signature, e))
+			return Nil;
+		source += generate_wrapper(e.entry, wrapper_name_for(e.entry), e.ret, e.args);
+		typed.push_back(std::move(e));
+	}
+	auto shared_source = std::make_shared<const std::string>(std::move(source));
+
+	Dictionary result = Dictionary::Create();
+	for (const auto &[name, signature] : names) {
+		if (!signature.empty())
+			continue;
+		Variant callable = function_callable(untyped_handle(shared_source, name));
+		if (callable.get_type() == Variant::NIL)
+			return Nil;
+		result.set(String(name), callable);
+	}
+	for (TypedExport &e : typed) {
+		const std::string name = e.entry;
+		Variant callable = function_callable(typed_handle(shared_source, std::move(e)));
+		if (callable.get_type() == Variant::NIL)
+			return Nil;
+		result.set(String(name), callable);
+	}
+	return result;
+}
+
+static Variant cache_stats() {
+	Dictionary stats = Dictionary::Create();
+	stats.set("hits", int64_t(module_stats.hits));
+	stats.set("misses", int64_t(module_stats.misses));
+	stats.set("evictions", int64_t(module_stats.evictions));
+	stats.set("errors", int64_t(module_stats.errors));
+	stats.set("modules", int64_t(module_lru.size()));
+	stats.set("bytes", int64_t(module_bytes));
+	stats.set("budget", int64_t(module_budget));
+	stats.set("functions", int64_t(compiled_functions.size()));
+	return stats;
+}
+
+static Variant set_cache_budget(int kb) {
+	module_budget = size_t(std::max(kb, 0)) << 10;
+	module_cache_evict(0);
+	return Nil;
+}
+
+// Output from the print_* helpers is buffered, see log_channel.hpp
+static Variant flush_output() {
+	log_channel.flush();
+	return Nil;
+}
+
+// Tests. Each returns true on success.
+
+static bool test_untyped_eviction() {
+	auto source = std::make_shared<const std::string>(
+			"struct Variant test_answer(void) { struct Variant v = { 2, 42 }; return v; }\n");
+	const int64_t handle = untyped_handle(source, "test_answer");
+	if (handle < 0)
+		return false;
+	module_cache_clear();
+	const bool evicted = compiled_functions[size_t(handle & 0xFFFFFFFF)].state == nullptr;
+	const Variant result = untyped_trampoline(handle);
+	return evicted && result.get_type() == Variant::INT && int64_t(result) == 42;
+}
+
+static int64_t test_typed_add() {
+	TypedExport e;
+	if (!parse_export("test_add", "float(float, float)", e))
+		return -1;
+	auto source = std::make_shared<const std::string>("double test_add(double a, double b) { return a + b; }\n" +
+			generate_wrapper(e.entry, wrapper_name_for(e.entry), e.ret, e.args));
+	return typed_handle(source, std::move(e));
+}
+
+static bool test_typed_eviction() {
+	const int64_t handle = test_typed_add();
+	if (handle < 0)
+		return false;
+	module_cache_clear();
+	const bool evicted = compiled_functions[size_t(handle & 0xFFFFFFFF)].state == nullptr;
+	const Variant args[] = { 1.5, 2.0 };
+	const Variant result = typed_call(handle, args, 2);
+	return evicted && result.get_type() == Variant::FLOAT && double(result) == 3.5;
+}
+
+static bool test_module_eviction() {
+	TypedExport e;
+	if (!parse_export("test_twice", "float(float)", e))
+		return false;
+	auto source = std::make_shared<const std::string>(
+			"struct Variant test_get(void) { struct Variant v = { 2, 5 }; return v; }\n"
+			"double test_twice(double x) { return x * 2; }\n" +
+			generate_wrapper(e.entry, wrapper_name_for(e.entry), e.ret, e.args));
+	const int64_t untyped = untyped_handle(source, "test_get");
+	const int64_t typed = typed_handle(source, std::move(e));
+	if (untyped < 0 || typed < 0)
+		return false;
+	// Both exports are compiled again as one module
+	module_cache_clear();
+	const uint64_t misses = module_stats.misses;
+	const Variant got = untyped_trampoline(untyped);
+	const Variant arg = 1.25;
+	const Variant twice = typed_call(typed, &arg, 1);
+	return module_stats.misses == misses + 1 && got.get_type() == Variant::INT && int64_t(got) == 5 &&
+			twice.get_type() == Variant::FLOAT && double(twice) == 2.5;
+}
+
+static bool test_function_table_bound() {
+	const size_t max = compiled_functions_max;
+	if (test_typed_add() < 0)
+		return false;
+	// With a full table, a new function takes the slot of an evicted one. The
+	// source is new on every run, so that it is never found in the table.
+	static int runs = 0;
+	auto source = std::make_shared<const std::string>("/* " + std::to_string(runs++) +
+			" */ struct Variant test_bound(void) { struct Variant v = { 2, 7 }; return v; }\n");
+	module_cache_clear();
+	const size_t size = compiled_functions.size();
+	compiled_functions_max = size;
+	const int64_t reused = untyped_handle(source, "test_bound");
+	compiled_functions_max = max;
+	if (reused < 0 || compiled_functions.size() != size || (reused >> 32) < 2)
+		return false;
+	const Variant result = untyped_trampoline(reused);
+	if (result.get_type() != Variant::INT || int64_t(result) != 7)
+		return false;
+	// The handle which referred to the previous function in the slot is released
+	const int64_t stale = (reused & 0xFFFFFFFF) | ((reused >> 32) - 1) << 32;
+	return compiled_function_get(stale) == nullptr;
+}
+
+static Variant run_tests() {
+	LogFlushGuard flush_guard;
+	bool all_tests_passed = true;
+	if (!test_untyped_eviction()) {
+		log_channel.printf("test_untyped_eviction failed\n");
+		all_tests_passed = false;
+	}
+	if (!test_typed_eviction()) {
+		log_channel.printf("test_typed_eviction failed\n");
+		all_tests_passed = false;
+	}
+	if (!test_module_eviction()) {
+		log_channel.printf("test_module_eviction failed\n");
+		all_tests_passed = false;
+	}
+	if (!test_function_table_bound()) {
+		log_channel.printf("test_function_table_bound failed\n");
+		all_tests_passed = false;
+	}
+	if (all_tests_passed) {
+		log_channel.printf("All tests passed!\n");
+		return 0;
+	}
+	log_channel.printf("Some tests failed.\n");
+	return 1;
 }
 
 int main() {
+	tcc_set_realloc(tcc_tracking_realloc);
+
 	// The public API
 	ADD_API_FUNCTION(compile, "Callable", "String code, String entry");
+	ADD_API_FUNCTION(compile_typed, "Callable", "String code, String entry, String signature",
+		"Compile C code and return its entry function, which takes typed arguments given by a signature "
+		"like \"float(float, float)\"");
+	ADD_API_FUNCTION(compile_module, "Dictionary", "String code, Variant exports",
+		"Compile C code once and return a Callable for each export. Exports is an Array of names, "
+		"or a Dictionary of names and signatures");
+	ADD_API_FUNCTION(cache_stats, "Dictionary", "",
+		"Compile cache hits, misses, evictions, memory use and function count");
+	ADD_API_FUNCTION(set_cache_budget, "void", "int kb",
+		"Set the memory budget of compiled code; evicted code is compiled again when called");
+	ADD_API_FUNCTION(flush_output, "void", "", "Write buffered output from compiled code");
+	ADD_API_FUNCTION(run_tests, "int", "", "Runs all tests");
 
 	halt();
 }
@@ -0,0 +1,185 @@
+#include "allocator.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+namespace {
+
+constexpr size_t CLASS_SIZES[LUA_ALLOC_NUM_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024
+};
+constexpr size_t MAX_CLASS_SIZE = CLASS_SIZES[LUA_ALLOC_NUM_CLASSES - 1];
+
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+FreeBlock *free_lists[LUA_ALLOC_NUM_CLASSES] {};
+// The arena currently being carved into blocks
+char *arena_cursor = nullptr;
+char *arena_end = nullptr;
+LuaAllocStats stats;
+
+bool site_tracking = false;
+LuaAllocSite pending; // Not attributed to a site yet
+std::unordered_map<std::string, LuaAllocSite> sites;
+
+// Map a size to its class, using a table indexed by size / 16
+struct ClassLookup {
+	uint8_t table[MAX_CLASS_SIZE / 16 + 1];
+	constexpr ClassLookup() : table() {
+		size_t cls = 0;
+		for (size_t i = 0; i <= MAX_CLASS_SIZE / 16; i++) {
+			while (CLASS_SIZES[cls] < i * 16)
+				cls++;
+			table[i] = uint8_t(cls);
+		}
+	}
+};
+constexpr ClassLookup class_lookup;
+
+inline size_t size_class(size_t size) {
+	return class_lookup.table[(size + 15) / 16];
+}
+
+void *alloc_small(size_t cls) {
+	stats.class_live[cls]++;
+	stats.class_total[cls]++;
+	if (FreeBlock *block = free_lists[cls]) {
+		free_lists[cls] = block->next;
+		return block;
+	}
+	const size_t size = CLASS_SIZES[cls];
+	if (arena_cursor == nullptr || size_t(arena_end - arena_cursor) < size) {
+		// Hand out what is left of the current arena as smaller blocks
+		while (arena_cursor != nullptr && size_t(arena_end - arena_cursor) >= CLASS_SIZES[0]) {
+			const size_t rest = size_class(size_t(arena_end - arena_cursor));
+			const size_t fit = CLASS_SIZES[rest] <= size_t(arena_end - arena_cursor) ? rest : rest - 1;
+			FreeBlock *block = (FreeBlock *)arena_cursor;
+			block->next = free_lists[fit];
+			free_lists[fit] = block;
+			arena_cursor += CLASS_SIZES[fit];
+		}
+		arena_cursor = (char *)malloc(LUA_ALLOC_ARENA_SIZE);
+		if (arena_cursor == nullptr) {
+			arena_end = nullptr;
+			stats.class_live[cls]--;
+			stats.class_total[cls]--;
+			return nullptr;
+		}
+		arena_end = arena_cursor + LUA_ALLOC_ARENA_SIZE;
+		stats.arena_bytes += LUA_ALLOC_ARENA_SIZE;
+	}
+	void *block = arena_cursor;
+	arena_cursor += size;
+	return block;
+}
+
+void free_small(void *ptr, size_t cls) {
+	stats.class_live[cls]--;
+	FreeBlock *block = (FreeBlock *)ptr;
+	block->next = free_lists[cls];
+	free_lists[cls] = block;
+}
+
+void *alloc_block(size_t size) {
+	if (size <= MAX_CLASS_SIZE)
+		return alloc_small(size_class(size));
+	void *ptr = malloc(size);
+	if (ptr != nullptr) {
+		stats.large_allocs++;
+		stats.large_bytes += size;
+	}
+	return ptr;
+}
+
+void free_block(void *ptr, size_t size) {
+	if (size <= MAX_CLASS_SIZE) {
+		free_small(ptr, size_class(size));
+		return;
+	}
+	stats.large_allocs--;
+	stats.large_bytes -= size;
+	free(ptr);
+}
+
+} // namespace
+
+void *lua_pool_alloc(void *, void *ptr, size_t osize, size_t nsize) {
+	if (ptr == nullptr)
+		osize = 0;
+
+	if (nsize == 0) {
+		if (ptr != nullptr) {
+			free_block(ptr, osize);
+			stats.bytes -= osize;
+			stats.total_frees++;
+		}
+		return nullptr;
+	}
+
+	void *result;
+	if (ptr == nullptr) {
+		result = alloc_block(nsize);
+		if (result == nullptr)
+			return nullptr;
+		stats.total_allocs++;
+	} else if (osize <= MAX_CLASS_SIZE && nsize <= MAX_CLASS_SIZE && size_class(osize) == size_class(nsize)) {
+		// Still fits in the same block
+		result = ptr;
+	} else if (osize > MAX_CLASS_SIZE && nsize > MAX_CLASS_SIZE) {
+		result = realloc(ptr, nsize);
+		if (result == nullptr)
+			return nullptr;
+		stats.large_bytes += nsize;
+		stats.large_bytes -= osize;
+	} else {
+		result = alloc_block(nsize);
+		if (result == nullptr)
+			return nullptr; // Lua keeps the old block
+		memcpy(result, ptr, osize < nsize ? osize : nsize);
+		free_block(ptr, osize);
+	}
+
+	stats.bytes += nsize;
+	stats.bytes -= osize;
+	if (stats.bytes > stats.peak_bytes)
+		stats.peak_bytes = stats.bytes;
+	if (site_tracking && nsize > osize) {
+		pending.count += ptr == nullptr;
+		pending.bytes += nsize - osize;
+	}
+	return result;
+}
+
+void lua_alloc_set_site_tracking(bool enable) {
+	site_tracking = enable;
+	pending = LuaAllocSite();
+}
+
+void lua_alloc_attribute(const char *site) {
+	if (pending.bytes == 0 && pending.count == 0)
+		return;
+	LuaAllocSite &entry = sites[site];
+	entry.count += pending.count;
+	entry.bytes += pending.bytes;
+	pending = LuaAllocSite();
+}
+
+void lua_alloc_visit_sites(void (*visit)(const char *site, const LuaAllocSite &, void *), void *user, bool clear) {
+	for (const auto &[name, site] : sites) {
+		visit(name.c_str(), site, user);
+	}
+	if (clear)
+		sites.clear();
+}
+
+size_t lua_alloc_class_size(size_t cls) {
+	return CLASS_SIZES[cls];
+}
+
+const LuaAllocStats &lua_alloc_stats() {
+	return stats;
+}
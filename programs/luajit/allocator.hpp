@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// A size-class pool allocator for the Lua state. Small blocks come from
+// per-class free lists carved out of larger arenas, bigger blocks go straight
+// to malloc. Arenas are kept for reuse and never returned to the system.
+static constexpr size_t LUA_ALLOC_NUM_CLASSES = 12;
+static constexpr size_t LUA_ALLOC_ARENA_SIZE = 64 * 1024;
+
+struct LuaAllocStats {
+	size_t bytes = 0;          // Currently allocated, as requested by Lua
+	size_t peak_bytes = 0;
+	size_t arena_bytes = 0;    // Reserved for small blocks
+	size_t large_bytes = 0;    // Currently allocated with malloc
+	uint64_t total_allocs = 0;
+	uint64_t total_frees = 0;
+	uint64_t large_allocs = 0; // Live blocks larger than the biggest size class
+	uint64_t class_live[LUA_ALLOC_NUM_CLASSES] {};
+	uint64_t class_total[LUA_ALLOC_NUM_CLASSES] {};
+};
+
+// Allocation-site tracking. While enabled, the allocator only counts new
+// blocks and the bytes of growing reallocations. It cannot look at the Lua
+// stack (which may itself be the block being reallocated), so the caller
+// samples the running line outside of the allocator, and attributes what was
+// allocated since the previous sample to it.
+struct LuaAllocSite {
+	uint64_t count = 0;
+	uint64_t bytes = 0;
+};
+void lua_alloc_set_site_tracking(bool enable);
+// Attribute the allocations counted since the last call to a site
+void lua_alloc_attribute(const char *site);
+// Visit the recorded sites, and clear them if requested
+void lua_alloc_visit_sites(void (*visit)(const char *site, const LuaAllocSite &, void *), void *user, bool clear);
+
+// The lua_Alloc function, for lua_newstate
+void *lua_pool_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+size_t lua_alloc_class_size(size_t cls);
+const LuaAllocStats &lua_alloc_stats();
@@ -0,0 +1,391 @@
+#include "convert.hpp"
+
+#include "godot_module.hpp"
+#include "log_channel.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+extern "C" {
+#include <lauxlib.h>
+#include <lua.h>
+}
+
+static bool pack_numeric_tables = true;
+
+// vmath structs. vmath is loaded through require() on the first conversion
+// which involves a vector, not when the state is created. The ctype id of a
+// cdata value is read from its header, just below the payload returned by
+// lua_topointer(). The offset is checked against ffi.typeof() when vmath is
+// loaded, and the bridge is disabled if it does not match this LuaJIT build.
+static constexpr int LUA_TCDATA = 10; // Not in lua.h, see lj_obj.h
+struct VmathBridge {
+	bool loaded = false; // Loading was attempted
+	bool enabled = false;
+	ptrdiff_t ctypeid_offset = 0;
+	uint32_t vector2_id = 0;
+	uint32_t vector3_id = 0;
+	int vector2_ref = LUA_NOREF; // Constructors
+	int vector3_ref = LUA_NOREF;
+};
+static VmathBridge vmath;
+
+static uint32_t cdata_ctypeid(const void *payload, ptrdiff_t offset) {
+	return *(const uint16_t *)((const char *)payload + offset);
+}
+
+static bool vmath_enabled(lua_State *L) {
+	if (vmath.loaded)
+		return vmath.enabled;
+	vmath.loaded = true;
+	static const char source[] = R"(
+local ffi = require("ffi")
+local vmath = require("vmath")
+return vmath.Vector2, vmath.Vector3, tonumber(ffi.typeof(vmath.Vector2)), tonumber(ffi.typeof(vmath.Vector3)),
+	vmath.Vector3(0, 0, 0)
+)";
+	if (luaL_loadbuffer(L, source, sizeof(source) - 1, "=vmath_bridge") != 0 || lua_pcall(L, 0, 5, 0) != 0) {
+		lua_pop(L, 1); // No ffi or no vmath, use tables
+		return false;
+	}
+	vmath.vector2_id = uint32_t(lua_tonumber(L, -3));
+	vmath.vector3_id = uint32_t(lua_tonumber(L, -2));
+	// GC64 has an 8-byte GC reference in the header, otherwise 4 bytes
+	const void *sample = lua_topointer(L, -1);
+	for (const ptrdiff_t offset : { ptrdiff_t(-6), ptrdiff_t(-2) }) {
+		if (cdata_ctypeid(sample, offset) == vmath.vector3_id) {
+			vmath.ctypeid_offset = offset;
+			vmath.enabled = true;
+			break;
+		}
+	}
+	lua_pop(L, 3);
+	if (vmath.enabled) {
+		vmath.vector3_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		vmath.vector2_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	} else {
+		lua_pop(L, 2);
+	}
+	return vmath.enabled;
+}
+
+void convert_set_pack_numeric(bool enable) {
+	pack_numeric_tables = enable;
+}
+
+namespace {
+
+struct ToVariantContext {
+	std::vector<const void *> visiting; // Tables on the current path, for cycle detection
+};
+
+enum class TableKind {
+	Sequence,
+	Int32Sequence,
+	FloatSequence,
+	Map,
+};
+
+void warn(const char *message) {
+	log_channel.printf("Lua conversion: %s\n", message);
+}
+
+Variant string_variant(lua_State *L, int idx) {
+	size_t len;
+	const char *str = lua_tolstring(L, idx, &len);
+	return String(std::string_view(str, len));
+}
+
+Variant number_variant(lua_Number n) {
+	const int64_t i = int64_t(n);
+	if (lua_Number(i) == n)
+		return i;
+	return double(n);
+}
+
+// One pass over the table to decide how it should be converted
+TableKind classify_table(lua_State *L, int idx) {
+	const size_t len = lua_objlen(L, idx);
+	size_t count = 0;
+	bool all_numbers = true;
+	bool all_int32 = true;
+
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		count++;
+		bool sequence_key = false;
+		if (lua_type(L, -2) == LUA_TNUMBER) {
+			const lua_Number key = lua_tonumber(L, -2);
+			sequence_key = key >= 1 && key <= lua_Number(len) && key == lua_Number(size_t(key));
+		}
+		if (!sequence_key) {
+			lua_pop(L, 2);
+			return TableKind::Map;
+		}
+		if (lua_type(L, -1) == LUA_TNUMBER) {
+			const lua_Number value = lua_tonumber(L, -1);
+			if (!(value >= INT32_MIN && value <= INT32_MAX && value == lua_Number(int32_t(value))))
+				all_int32 = false;
+		} else {
+			all_numbers = false;
+		}
+		lua_pop(L, 1);
+	}
+
+	// A table with holes in 1..n is not a sequence
+	if (count != len)
+		return TableKind::Map;
+	if (len > 0 && all_numbers && pack_numeric_tables)
+		return all_int32 ? TableKind::Int32Sequence : TableKind::FloatSequence;
+	return TableKind::Sequence;
+}
+
+Variant to_variant(lua_State *L, int idx, ToVariantContext &ctx);
+
+Variant cdata_to_variant(lua_State *L, int idx) {
+	if (!vmath_enabled(L))
+		return Variant();
+	const double *v = (const double *)lua_topointer(L, idx);
+	const uint32_t id = cdata_ctypeid(v, vmath.ctypeid_offset);
+	if (id == vmath.vector3_id)
+		return Vector3(v[0], v[1], v[2]);
+	if (id == vmath.vector2_id)
+		return Vector2(v[0], v[1]);
+	return Variant();
+}
+
+// Push a vmath struct through its constructor, or a table without vmath
+void push_vector(lua_State *L, const double *v, int n) {
+	static const char *const fields[] = { "x", "y", "z" };
+	if (vmath_enabled(L)) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, n == 2 ? vmath.vector2_ref : vmath.vector3_ref);
+		for (int i = 0; i < n; i++) {
+			lua_pushnumber(L, v[i]);
+		}
+		lua_call(L, n, 1);
+		return;
+	}
+	lua_createtable(L, 0, n);
+	for (int i = 0; i < n; i++) {
+		lua_pushnumber(L, v[i]);
+		lua_setfield(L, -2, fields[i]);
+	}
+}
+
+Variant table_to_variant(lua_State *L, int idx, ToVariantContext &ctx) {
+	const void *ptr = lua_topointer(L, idx);
+	for (const void *visiting : ctx.visiting) {
+		if (visiting == ptr) {
+			warn("cycle detected, converted to nil");
+			return Variant();
+		}
+	}
+	if (ctx.visiting.size() >= size_t(CONVERT_MAX_DEPTH)) {
+		warn("table nesting too deep, converted to nil");
+		return Variant();
+	}
+	if (!lua_checkstack(L, 4)) {
+		warn("out of Lua stack space, converted to nil");
+		return Variant();
+	}
+
+	const size_t len = lua_objlen(L, idx);
+	switch (classify_table(L, idx)) {
+		case TableKind::Int32Sequence: {
+			std::vector<int32_t> values(len);
+			for (size_t i = 0; i < len; i++) {
+				lua_rawgeti(L, idx, int(i + 1));
+				values[i] = int32_t(lua_tonumber(L, -1));
+				lua_pop(L, 1);
+			}
+			return PackedArray<int32_t>(values);
+		}
+		case TableKind::FloatSequence: {
+			std::vector<float> values(len);
+			for (size_t i = 0; i < len; i++) {
+				lua_rawgeti(L, idx, int(i + 1));
+				values[i] = float(lua_tonumber(L, -1));
+				lua_pop(L, 1);
+			}
+			return PackedArray<float>(values);
+		}
+		case TableKind::Sequence: {
+			ctx.visiting.push_back(ptr);
+			Array array = Array::Create();
+			for (size_t i = 0; i < len; i++) {
+				lua_rawgeti(L, idx, int(i + 1));
+				array.append(to_variant(L, lua_gettop(L), ctx));
+				lua_pop(L, 1);
+			}
+			ctx.visiting.pop_back();
+			return array;
+		}
+		case TableKind::Map:
+		default: {
+			ctx.visiting.push_back(ptr);
+			Dictionary dict = Dictionary::Create();
+			lua_pushnil(L);
+			while (lua_next(L, idx) != 0) {
+				// Number keys are read with lua_tonumber: lua_tolstring would convert
+				// them in place and confuse lua_next
+				Variant key;
+				switch (lua_type(L, -2)) {
+					case LUA_TSTRING:
+						key = string_variant(L, -2);
+						break;
+					case LUA_TNUMBER:
+						key = number_variant(lua_tonumber(L, -2));
+						break;
+					case LUA_TBOOLEAN:
+						key = bool(lua_toboolean(L, -2));
+						break;
+					default:
+						break;
+				}
+				if (key.get_type() != Variant::Type::NIL)
+					dict.set(key, to_variant(L, lua_gettop(L), ctx));
+				lua_pop(L, 1);
+			}
+			ctx.visiting.pop_back();
+			return dict;
+		}
+	}
+}
+
+Variant to_variant(lua_State *L, int idx, ToVariantContext &ctx) {
+	switch (lua_type(L, idx)) {
+		case LUA_TBOOLEAN:
+			return bool(lua_toboolean(L, idx));
+		case LUA_TNUMBER:
+			return double(lua_tonumber(L, idx));
+		case LUA_TSTRING:
+			return string_variant(L, idx);
+		case LUA_TTABLE:
+			return table_to_variant(L, idx, ctx);
+		case LUA_TUSERDATA: {
+			Variant object;
+			godot_to_object(L, idx, object);
+			return object;
+		}
+		case LUA_TCDATA:
+			return cdata_to_variant(L, idx);
+		default:
+			return Variant();
+	}
+}
+
+template <typename T>
+void push_packed(lua_State *L, const Variant &value) {
+	PackedArray<T> packed = value;
+	const std::vector<T> values = packed.fetch();
+	lua_createtable(L, int(values.size()), 0);
+	for (size_t i = 0; i < values.size(); i++) {
+		lua_pushnumber(L, lua_Number(values[i]));
+		lua_rawseti(L, -2, int(i + 1));
+	}
+}
+
+int push_variant(lua_State *L, const Variant &value, int depth) {
+	if (!lua_checkstack(L, 3)) {
+		warn("out of Lua stack space, converted to nil");
+		return 0;
+	}
+	switch (value.get_type()) {
+		case Variant::Type::NIL:
+			return 0;
+		case Variant::Type::BOOL:
+			lua_pushboolean(L, bool(value));
+			return 1;
+		case Variant::Type::INT:
+		case Variant::Type::FLOAT:
+			lua_pushnumber(L, double(value));
+			return 1;
+		case Variant::Type::STRING:
+		case Variant::Type::STRING_NAME: {
+			const std::string str = value.as_std_string();
+			lua_pushlstring(L, str.data(), str.size());
+			return 1;
+		}
+		case Variant::Type::OBJECT:
+			godot_push_object(L, value);
+			return 1;
+		case Variant::Type::VECTOR2: {
+			const Vector2 v = value.v2();
+			const double values[] = { v.x, v.y };
+			push_vector(L, values, 2);
+			return 1;
+		}
+		case Variant::Type::VECTOR3: {
+			const Vector3 v = value.v3();
+			const double values[] = { v.x, v.y, v.z };
+			push_vector(L, values, 3);
+			return 1;
+		}
+		case Variant::Type::PACKED_INT32_ARRAY:
+			push_packed<int32_t>(L, value);
+			return 1;
+		case Variant::Type::PACKED_INT64_ARRAY:
+			push_packed<int64_t>(L, value);
+			return 1;
+		case Variant::Type::PACKED_FLOAT32_ARRAY:
+			push_packed<float>(L, value);
+			return 1;
+		case Variant::Type::PACKED_FLOAT64_ARRAY:
+			push_packed<double>(L, value);
+			return 1;
+		case Variant::Type::ARRAY: {
+			// Godot containers can contain themselves, and there is no identity to
+			// compare here, so only the depth limit protects against cycles.
+			if (depth >= CONVERT_MAX_DEPTH) {
+				warn("Array nesting too deep, converted to nil");
+				return 0;
+			}
+			Array array = value.as_array();
+			const int size = array.size();
+			lua_createtable(L, size, 0);
+			for (int i = 0; i < size; i++) {
+				if (push_variant(L, array[i].get(), depth + 1) == 0)
+					lua_pushboolean(L, 0); // Keep the sequence without holes
+				lua_rawseti(L, -2, i + 1);
+			}
+			return 1;
+		}
+		case Variant::Type::DICTIONARY: {
+			if (depth >= CONVERT_MAX_DEPTH) {
+				warn("Dictionary nesting too deep, converted to nil");
+				return 0;
+			}
+			Dictionary dict = value.as_dictionary();
+			Array keys = dict.keys();
+			const int size = keys.size();
+			lua_createtable(L, 0, size);
+			for (int i = 0; i < size; i++) {
+				const Variant key = keys[i].get();
+				if (push_variant(L, key, depth + 1) == 0)
+					continue;
+				if (push_variant(L, dict[key].value(), depth + 1) == 0) {
+					lua_pop(L, 1);
+					continue;
+				}
+				lua_rawset(L, -3);
+			}
+			return 1;
+		}
+		default:
+			return 0;
+	}
+}
+
+} // namespace
+
+Variant lua_to_variant(lua_State *L, int idx) {
+	ToVariantContext ctx;
+	if (idx < 0 && idx > LUA_REGISTRYINDEX)
+		idx = lua_gettop(L) + idx + 1;
+	return to_variant(L, idx, ctx);
+}
+
+int push_variant(lua_State *L, const Variant &value) {
+	return push_variant(L, value, 0);
+}
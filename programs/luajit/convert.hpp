@@ -0,0 +1,27 @@
+#pragma once
+#include <api.hpp>
+struct lua_State;
+
+// Conversion between Lua values and Variants.
+//
+// Lua tables which are sequences (keys 1..n) become an Array, other tables a
+// Dictionary. When packing is enabled, sequences of numbers are transferred
+// in one go as a PackedInt32Array (all integers in range) or otherwise a
+// PackedFloat32Array. Tables are converted recursively, with cycle detection
+// and a nesting depth limit; offending values become Nil with a warning.
+// Godot objects become references from the godot module, and back.
+// Vector2 and Vector3 become vmath structs, and back.
+static constexpr int CONVERT_MAX_DEPTH = 32;
+
+// Convert the Lua value at index idx into a Variant
+Variant lua_to_variant(lua_State *L, int idx);
+
+// Push a Variant onto the Lua stack. Returns the number of values pushed (0 for Nil).
+int push_variant(lua_State *L, const Variant &value);
+
+// Vector2 and Vector3 convert to and from the FFI structs of the vmath
+// module, which is loaded on the first such conversion. Without ffi or
+// package, they convert to and from { x = .., y = .., z = .. }.
+
+// Enable or disable the numeric packed array fast path (on by default)
+void convert_set_pack_numeric(bool enable);
@@ -0,0 +1,8 @@
+# Embed a Lua source file as a C array, in the same format as "luajit -b -t h".
+# Used when no host LuaJIT is available to precompile the module to bytecode.
+# Usage: cmake -DNAME=<module> -DINPUT=<file.lua> -DOUTPUT=<file.h> -P embed_lua.cmake
+file(READ ${INPUT} content HEX)
+string(LENGTH "${content}" hex_length)
+math(EXPR size "${hex_length} / 2")
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${content}")
+file(WRITE ${OUTPUT} "#define luaJIT_BC_${NAME}_SIZE ${size}\nstatic const unsigned char luaJIT_BC_${NAME}[] = {\n${bytes}\n};\n")
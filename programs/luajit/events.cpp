@@ -0,0 +1,293 @@
+#include "events.hpp"
+
+#include "convert.hpp"
+#include "log_channel.hpp"
+#include <unordered_map>
+#include <vector>
+extern "C" {
+#include <lauxlib.h>
+#include <lua.h>
+}
+
+namespace {
+
+constexpr const char *HANDLER_REGISTRY = "godot.event_handlers";
+
+// Arguments are copied out of their Variants when queued, because complex
+// Variants only live for the duration of the signal call. Objects cannot be
+// copied: their Variants are held in queued_objects until dispatch_events()
+// has delivered them, and only an object which reaches Lua is kept longer
+// (see godot_push_object()).
+enum class ArgKind : uint8_t {
+	Nil,
+	Bool,
+	Number,
+	String,
+	Vector2,
+	Vector3,
+	Object,
+};
+struct EventArg {
+	ArgKind kind;
+	uint32_t index; // Into strings or objects
+	double values[3];
+};
+struct EventRecord {
+	uint32_t id;
+	uint32_t first_arg;
+	uint32_t nargs;
+};
+
+std::vector<EventRecord> queue;
+std::vector<EventArg> queued_args;
+std::vector<std::string> queued_strings;
+std::vector<Variant> queued_objects;
+std::unordered_map<std::string, uint32_t> event_ids;
+std::vector<std::string> event_names;
+uint64_t total_queued = 0;
+uint64_t total_dispatched = 0;
+uint64_t total_unhandled = 0;
+
+uint32_t intern_event(const std::string &name) {
+	auto it = event_ids.find(name);
+	if (it != event_ids.end())
+		return it->second;
+	const uint32_t id = uint32_t(event_names.size());
+	event_names.push_back(name);
+	event_ids.emplace(name, id);
+	return id;
+}
+
+EventArg pack_arg(const Variant &value) {
+	EventArg arg { ArgKind::Nil, 0, { 0, 0, 0 } };
+	switch (value.get_type()) {
+		case Variant::Type::BOOL:
+			arg.kind = ArgKind::Bool;
+			arg.values[0] = bool(value);
+			break;
+		case Variant::Type::INT:
+		case Variant::Type::FLOAT:
+			arg.kind = ArgKind::Number;
+			arg.values[0] = double(value);
+			break;
+		case Variant::Type::STRING:
+		case Variant::Type::STRING_NAME:
+			arg.kind = ArgKind::String;
+			arg.index = uint32_t(queued_strings.size());
+			queued_strings.push_back(value.as_std_string());
+			break;
+		case Variant::Type::VECTOR2: {
+			const Vector2 v = value.v2();
+			arg.kind = ArgKind::Vector2;
+			arg.values[0] = v.x;
+			arg.values[1] = v.y;
+			break;
+		}
+		case Variant::Type::VECTOR3: {
+			const Vector3 v = value.v3();
+			arg.kind = ArgKind::Vector3;
+			arg.values[0] = v.x;
+			arg.values[1] = v.y;
+			arg.values[2] = v.z;
+			break;
+		}
+		case Variant::Type::OBJECT:
+			arg.kind = ArgKind::Object;
+			arg.index = uint32_t(queued_objects.size());
+			queued_objects.push_back(value);
+			break;
+		default:
+			break;
+	}
+	return arg;
+}
+
+void enqueue(const Variant &id, const Variant *args, int nargs) {
+	queue.push_back(EventRecord { uint32_t(int64_t(id)), uint32_t(queued_args.size()), uint32_t(nargs) });
+	for (int i = 0; i < nargs; i++) {
+		queued_args.push_back(pack_arg(args[i]));
+	}
+	total_queued++;
+}
+
+// One trampoline per signal arity. The event id is bound as the last argument.
+Variant event_trampoline_0(Variant id) {
+	enqueue(id, nullptr, 0);
+	return Nil;
+}
+Variant event_trampoline_1(Variant a0, Variant id) {
+	const Variant args[] = { a0 };
+	enqueue(id, args, 1);
+	return Nil;
+}
+Variant event_trampoline_2(Variant a0, Variant a1, Variant id) {
+	const Variant args[] = { a0, a1 };
+	enqueue(id, args, 2);
+	return Nil;
+}
+Variant event_trampoline_3(Variant a0, Variant a1, Variant a2, Variant id) {
+	const Variant args[] = { a0, a1, a2 };
+	enqueue(id, args, 3);
+	return Nil;
+}
+Variant event_trampoline_4(Variant a0, Variant a1, Variant a2, Variant a3, Variant id) {
+	const Variant args[] = { a0, a1, a2, a3 };
+	enqueue(id, args, 4);
+	return Nil;
+}
+
+Callable trampoline_for(int arity) {
+	switch (arity) {
+		case 0:
+			return Callable::Create<Variant(Variant)>(event_trampoline_0);
+		case 1:
+			return Callable::Create<Variant(Variant, Variant)>(event_trampoline_1);
+		case 2:
+			return Callable::Create<Variant(Variant, Variant, Variant)>(event_trampoline_2);
+		case 3:
+			return Callable::Create<Variant(Variant, Variant, Variant, Variant)>(event_trampoline_3);
+		default:
+			return Callable::Create<Variant(Variant, Variant, Variant, Variant, Variant)>(event_trampoline_4);
+	}
+}
+
+// The number of arguments of a signal, from the object's signal list, or -1
+int signal_arity(const Variant &object, const std::string &signal) {
+	Variant list;
+	object.callp("get_signal_list", nullptr, 0, list);
+	Array signals = list.as_array();
+	for (int i = 0; i < signals.size(); i++) {
+		Dictionary info = signals[i].get().as_dictionary();
+		if (info["name"].value().as_std_string() == signal)
+			return info["args"].value().as_array().size();
+	}
+	return -1;
+}
+
+void push_arg(lua_State *L, const EventArg &arg, const std::vector<std::string> &strings,
+		const std::vector<Variant> &objects) {
+	switch (arg.kind) {
+		case ArgKind::Bool:
+			lua_pushboolean(L, arg.values[0] != 0);
+			break;
+		case ArgKind::Number:
+			lua_pushnumber(L, arg.values[0]);
+			break;
+		case ArgKind::String: {
+			const std::string &str = strings[arg.index];
+			lua_pushlstring(L, str.data(), str.size());
+			break;
+		}
+		case ArgKind::Vector2:
+			push_variant(L, Vector2(arg.values[0], arg.values[1]));
+			break;
+		case ArgKind::Vector3:
+			push_variant(L, Vector3(arg.values[0], arg.values[1], arg.values[2]));
+			break;
+		case ArgKind::Object:
+			if (push_variant(L, objects[arg.index]) == 0)
+				lua_pushnil(L);
+			break;
+		default:
+			lua_pushnil(L);
+			break;
+	}
+}
+
+// on_event(name, fn): set the handler for an event, or remove it with nil
+int api_on_event(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_getfield(L, LUA_REGISTRYINDEX, HANDLER_REGISTRY);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, int(intern_event(name)));
+	return 0;
+}
+
+} // namespace
+
+void events_register(lua_State *L) {
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, HANDLER_REGISTRY);
+	lua_register(L, "on_event", api_on_event);
+}
+
+int64_t events_connect(const Variant &object, const std::string &signal, const std::string &name) {
+	const int arity = signal_arity(object, signal);
+	if (arity < 0 || arity > EVENT_MAX_ARGS) {
+		log_channel.printf("connect_event: %s is not a signal with at most %d arguments\n", signal.c_str(), EVENT_MAX_ARGS);
+		return -1;
+	}
+	const uint32_t id = intern_event(name);
+
+	Variant callable = trampoline_for(arity);
+	Variant bound;
+	const Variant id_variant = int64_t(id);
+	callable.callp("bind", &id_variant, 1, bound);
+
+	const Variant connect_args[] = { String(signal), bound };
+	Variant result;
+	object.callp("connect", connect_args, 2, result);
+	return id;
+}
+
+void events_remove_handlers(lua_State *L, int env_index) {
+	lua_getfield(L, LUA_REGISTRYINDEX, HANDLER_REGISTRY);
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		// Assigning nil to an existing field is allowed during traversal
+		lua_getfenv(L, -1);
+		const bool in_env = lua_rawequal(L, -1, env_index);
+		lua_pop(L, 2);
+		if (in_env) {
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, -4);
+		}
+	}
+	lua_pop(L, 1);
+}
+
+int64_t events_dispatch(lua_State *L) {
+	// Handlers may cause new events, which are dispatched next time
+	std::vector<EventRecord> records;
+	std::vector<EventArg> args;
+	std::vector<std::string> strings;
+	std::vector<Variant> objects;
+	records.swap(queue);
+	args.swap(queued_args);
+	strings.swap(queued_strings);
+	objects.swap(queued_objects);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, HANDLER_REGISTRY);
+	const int handlers = lua_gettop(L);
+	for (const EventRecord &record : records) {
+		lua_rawgeti(L, handlers, int(record.id));
+		if (!lua_isfunction(L, -1)) {
+			lua_pop(L, 1);
+			total_unhandled++;
+			continue;
+		}
+		for (uint32_t i = 0; i < record.nargs; i++) {
+			push_arg(L, args[record.first_arg + i], strings, objects);
+		}
+		if (lua_pcall(L, int(record.nargs), 0, 0) != 0) {
+			log_channel.printf("Event %s handler error: %s\n", event_names[record.id].c_str(), lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+		total_dispatched++;
+	}
+	lua_pop(L, 1);
+	return int64_t(records.size());
+}
+
+Variant events_stats() {
+	Dictionary stats = Dictionary::Create();
+	stats.set("queued", int64_t(queue.size()));
+	stats.set("total_queued", int64_t(total_queued));
+	stats.set("total_dispatched", int64_t(total_dispatched));
+	stats.set("total_unhandled", int64_t(total_unhandled));
+	stats.set("event_names", int64_t(event_names.size()));
+	return stats;
+}
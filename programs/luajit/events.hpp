@@ -0,0 +1,29 @@
+#pragma once
+#include <api.hpp>
+#include <string>
+struct lua_State;
+
+// Batched event delivery. Godot signals are connected to native trampolines
+// which only append a compact record (event id plus packed arguments) to a
+// queue. dispatch_events() then drains the queue into the Lua handlers
+// registered with on_event(name, fn). This batches delivery to Lua: every
+// emission still enters the sandbox to run its trampoline, but Lua only runs
+// during dispatch_events().
+
+// Register on_event() in Lua
+void events_register(lua_State *L);
+
+// Connect a signal of an object to the queue under an event name. Signals with
+// up to EVENT_MAX_ARGS arguments are supported. Returns the event id, or -1.
+static constexpr int EVENT_MAX_ARGS = 4;
+int64_t events_connect(const Variant &object, const std::string &signal, const std::string &name);
+
+// Remove the handlers whose environment is the table at env_index (an
+// isolated state which is being destroyed)
+void events_remove_handlers(lua_State *L, int env_index);
+
+// Call the handlers for all queued events. Returns the number of events.
+int64_t events_dispatch(lua_State *L);
+
+// Queue and handler counters
+Variant events_stats();
@@ -0,0 +1,292 @@
+#include "godot_module.hpp"
+
+#include "convert.hpp"
+#include <cstdio>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+extern "C" {
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+}
+
+namespace {
+
+constexpr const char *CLASS_REGISTRY = "godot.classes";
+constexpr const char *OBJECT_MARKER = "__godot_object";
+
+// Objects are held by address, which stays valid after the call that passed
+// the object in, so a reference needs no permanent Variant
+struct ObjectRef {
+	Object object;
+	int64_t id; // Instance id
+
+	Variant variant() const { return Variant(object); }
+};
+
+// The metatable key and class name of each object seen, by instance id, so
+// that pushing an object again does not look up its class and script
+struct ClassInfo {
+	std::string key;
+	std::string name;
+};
+constexpr size_t CLASS_INFO_MAX = 4096;
+std::unordered_map<int64_t, ClassInfo> class_info_cache;
+
+// Argument buffer for method calls, nested calls use the space above the caller
+constexpr size_t ARG_STACK_SIZE = 64;
+Variant arg_stack[ARG_STACK_SIZE];
+size_t arg_stack_top = 0;
+
+ObjectRef *check_object(lua_State *L, int idx) {
+	if (lua_getmetatable(L, idx)) {
+		lua_getfield(L, -1, OBJECT_MARKER);
+		const bool is_object = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+		if (is_object)
+			return (ObjectRef *)lua_touserdata(L, idx);
+	}
+	luaL_typerror(L, idx, "Godot object");
+	return nullptr;
+}
+
+Variant name_variant(lua_State *L, int idx) {
+	size_t len;
+	const char *name = lua_tolstring(L, idx, &len);
+	return String(std::string_view(name, len));
+}
+
+// Method closure, with the interned method name as its upvalue
+int object_method(lua_State *L) {
+	ObjectRef *ref = check_object(L, 1);
+	size_t len;
+	const char *name = lua_tolstring(L, lua_upvalueindex(1), &len);
+
+	const int nargs = lua_gettop(L) - 1;
+	if (arg_stack_top + nargs > ARG_STACK_SIZE)
+		return luaL_error(L, "too many arguments to %s", name);
+	Variant *args = &arg_stack[arg_stack_top];
+	for (int i = 0; i < nargs; i++) {
+		args[i] = lua_to_variant(L, i + 2);
+	}
+
+	arg_stack_top += nargs;
+	Variant result;
+	ref->variant().callp(std::string_view(name, len), args, nargs, result);
+	arg_stack_top -= nargs;
+	return push_variant(L, result);
+}
+
+bool has_method(ObjectRef *ref, const Variant &name) {
+	Variant result;
+	ref->variant().callp("has_method", &name, 1, result);
+	return bool(result);
+}
+
+int object_index(lua_State *L) {
+	ObjectRef *ref = check_object(L, 1);
+	if (lua_type(L, 2) != LUA_TSTRING)
+		return 0;
+
+	lua_getmetatable(L, 1);
+	lua_getfield(L, -1, "__members");
+	const int members = lua_gettop(L);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, members);
+
+	Variant name;
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		// First use of this name on this class
+		name = name_variant(L, 2);
+		if (has_method(ref, name)) {
+			lua_pushvalue(L, 2);
+			lua_pushcclosure(L, object_method, 1);
+		} else {
+			lua_pushboolean(L, 1);
+		}
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, members);
+	}
+	if (lua_isfunction(L, -1))
+		return 1;
+
+	// A property
+	if (name.get_type() == Variant::Type::NIL)
+		name = name_variant(L, 2);
+	Variant result;
+	ref->variant().callp("get", &name, 1, result);
+	return push_variant(L, result);
+}
+
+int object_newindex(lua_State *L) {
+	ObjectRef *ref = check_object(L, 1);
+	luaL_checktype(L, 2, LUA_TSTRING);
+	Variant args[2] = { name_variant(L, 2), lua_to_variant(L, 3) };
+	Variant result;
+	ref->variant().callp("set", args, 2, result);
+	return 0;
+}
+
+int object_eq(lua_State *L) {
+	lua_pushboolean(L, check_object(L, 1)->id == check_object(L, 2)->id);
+	return 1;
+}
+
+int object_tostring(lua_State *L) {
+	ObjectRef *ref = check_object(L, 1);
+	lua_getmetatable(L, 1);
+	lua_getfield(L, -1, "__name");
+	lua_pushfstring(L, "%s#%s", lua_tostring(L, -1), std::to_string(ref->id).c_str());
+	return 1;
+}
+
+int object_gc(lua_State *L) {
+	ObjectRef *ref = (ObjectRef *)lua_touserdata(L, 1);
+	ref->~ObjectRef();
+	return 0;
+}
+
+// The members of an object are those of its native class plus those of its
+// script, so objects share a metatable when both match. The key is the class
+// name, followed by the script's instance id when there is one.
+const ClassInfo &class_info(const Variant &object, int64_t id) {
+	auto it = class_info_cache.find(id);
+	if (it != class_info_cache.end())
+		return it->second;
+	if (class_info_cache.size() >= CLASS_INFO_MAX)
+		class_info_cache.clear();
+
+	ClassInfo info;
+	Variant class_name;
+	object.callp("get_class", nullptr, 0, class_name);
+	info.name = class_name.as_std_string();
+	info.key = info.name;
+	Variant script;
+	object.callp("get_script", nullptr, 0, script);
+	if (script.get_type() == Variant::Type::OBJECT) {
+		Variant script_id;
+		script.callp("get_instance_id", nullptr, 0, script_id);
+		info.key += "@" + std::to_string(int64_t(script_id));
+	}
+	return class_info_cache.emplace(id, std::move(info)).first->second;
+}
+
+// Push the metatable for a class and script, creating it on first use
+void push_class_metatable(lua_State *L, const std::string &key, const std::string &class_name) {
+	lua_getfield(L, LUA_REGISTRYINDEX, CLASS_REGISTRY);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, CLASS_REGISTRY);
+	}
+	lua_getfield(L, -1, key.c_str());
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 8);
+		lua_pushboolean(L, 1);
+		lua_setfield(L, -2, OBJECT_MARKER);
+		lua_pushlstring(L, class_name.data(), class_name.size());
+		lua_setfield(L, -2, "__name");
+		lua_newtable(L);
+		lua_setfield(L, -2, "__members");
+		lua_pushcfunction(L, object_index);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, object_newindex);
+		lua_setfield(L, -2, "__newindex");
+		lua_pushcfunction(L, object_eq);
+		lua_setfield(L, -2, "__eq");
+		lua_pushcfunction(L, object_tostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, object_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, key.c_str());
+	}
+	lua_remove(L, -2);
+}
+
+// godot.get_node(path)
+int godot_get_node(lua_State *L) {
+	size_t len;
+	const char *path = luaL_checklstring(L, 1, &len);
+	Node node = get_node(std::string_view(path, len));
+	godot_push_object(L, Variant(node));
+	return 1;
+}
+
+// godot.is_object(value)
+int godot_is_object(lua_State *L) {
+	Variant object;
+	lua_pushboolean(L, godot_to_object(L, 1, object));
+	return 1;
+}
+
+// godot.refresh(object): look up the class and script of the object again,
+// after set_script()
+int godot_refresh(lua_State *L) {
+	ObjectRef *ref = check_object(L, 1);
+	class_info_cache.erase(ref->id);
+	const ClassInfo &info = class_info(ref->variant(), ref->id);
+	push_class_metatable(L, info.key, info.name);
+	lua_setmetatable(L, 1);
+	return 0;
+}
+
+// godot.class_name(object)
+int godot_class_name(lua_State *L) {
+	check_object(L, 1);
+	lua_getmetatable(L, 1);
+	lua_getfield(L, -1, "__name");
+	return 1;
+}
+
+int luaopen_godot(lua_State *L) {
+	static const luaL_Reg functions[] = {
+		{ "get_node", godot_get_node },
+		{ "is_object", godot_is_object },
+		{ "class_name", godot_class_name },
+		{ "refresh", godot_refresh },
+		{ nullptr, nullptr },
+	};
+	lua_newtable(L);
+	luaL_register(L, nullptr, functions);
+	return 1;
+}
+
+} // namespace
+
+void godot_module_register(lua_State *L) {
+	lua_getglobal(L, LUA_LOADLIBNAME);
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "preload");
+		lua_pushcfunction(L, luaopen_godot);
+		lua_setfield(L, -2, "godot");
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+void godot_push_object(lua_State *L, const Variant &object) {
+	Variant id;
+	object.callp("get_instance_id", nullptr, 0, id);
+	const ClassInfo &info = class_info(object, int64_t(id));
+	new (lua_newuserdata(L, sizeof(ObjectRef))) ObjectRef { Object(object), int64_t(id) };
+	push_class_metatable(L, info.key, info.name);
+	lua_setmetatable(L, -2);
+}
+
+bool godot_to_object(lua_State *L, int idx, Variant &out) {
+	if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx))
+		return false;
+	lua_getfield(L, -1, OBJECT_MARKER);
+	const bool is_object = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	if (is_object)
+		out = ((ObjectRef *)lua_touserdata(L, idx))->variant();
+	return is_object;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <api.hpp>
+struct lua_State;
+
+// The "godot" module: Lua references to Godot objects, with methods and
+// properties accessed by name (node:set_position(v), node.name).
+//
+// Each native class and script pair gets one metatable, which caches what
+// every member name resolves to: a method closure holding the interned name,
+// or a property. The class and script of an object are looked up the first
+// time it is pushed, and cached by instance id: after set_script() on the
+// object, godot.refresh(object) looks them up again.
+
+// Register the module in package.preload, as require("godot")
+void godot_module_register(lua_State *L);
+
+// Push an Object Variant as a Lua object reference
+void godot_push_object(lua_State *L, const Variant &object);
+
+// If the value at idx is an object reference, store it in out and return true
+bool godot_to_object(lua_State *L, int idx, Variant &out);
@@ -1,5 +1,20 @@
+#include "allocator.hpp"
+#include "convert.hpp"
+#include "events.hpp"
+#include "godot_module.hpp"
+#include "log_channel.hpp"
+#include "lua_modules.h"
+#include "profiler.hpp"
+#include "views.hpp"
 #include <api.hpp>
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <list>
+#include <new>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 extern "C" {
 #include <lauxlib.h>
 #include <lua.h>
@@ -19,118 +34,1639 @@ extern "C" Variant click() {
 }
 #else
 static int api_print(lua_State *L) {
-	const char *text = luaL_checkstring(L, 1);
-	printf("%s", text);
-	fflush(stdout);
+	size_t len;
+	const char *text = luaL_checklstring(L, 1, &len);
+	log_channel.write(std::string_view(text, len));
 	return 0;
 }
 #endif
 
+static int api_flush(lua_State *L) {
+	log_channel.flush();
+	return 0;
+}
+
 static lua_State *L;
+static bool pool_allocator = false;
+static void init_state();
+// The Lua state is created on first use, so that loading the program stays cheap
+static inline void ensure_state() {
+	if (L == nullptr)
+		init_state();
+}
 static constexpr bool VERBOSE = false;
 
+// Compiled chunks, keyed by a hash of their source. Each entry holds a registry
+// reference to the loaded function, so a repeated run() skips the parser.
+struct CachedChunk {
+	uint64_t hash;
+	std::string source;
+	int ref;
+};
+static std::list<CachedChunk> chunk_lru; // Most recently used first
+static std::unordered_map<uint64_t, std::list<CachedChunk>::iterator> chunk_map;
+static size_t chunk_capacity = 64;
+static struct {
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+	uint64_t load_errors = 0;
+} chunk_stats;
+
+static uint64_t fnv1a(const std::string &s) {
+	uint64_t hash = 14695981039346656037ull;
+	for (const unsigned char c : s) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static void chunk_cache_evict_lru() {
+	CachedChunk &last = chunk_lru.back();
+	luaL_unref(L, LUA_REGISTRYINDEX, last.ref);
+	chunk_map.erase(last.hash);
+	chunk_lru.pop_back();
+	chunk_stats.evictions++;
+}
+
+// Push the compiled function for the given source, loading it on a miss.
+// Returns false (with the error message pushed) if the source fails to load.
+static bool push_chunk(const std::string &utf, bool use_cache) {
+	const uint64_t hash = fnv1a(utf);
+	auto it = use_cache ? chunk_map.find(hash) : chunk_map.end();
+	if (it != chunk_map.end()) {
+		// Compare the full source, so that a hash collision can never run the wrong chunk
+		if (it->second->source == utf) {
+			chunk_stats.hits++;
+			chunk_lru.splice(chunk_lru.begin(), chunk_lru, it->second);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, it->second->ref);
+			return true;
+		}
+		// Collision: the new source replaces the old entry
+		luaL_unref(L, LUA_REGISTRYINDEX, it->second->ref);
+		chunk_lru.erase(it->second);
+		chunk_map.erase(it);
+	}
+	chunk_stats.misses++;
+
+	if (luaL_loadbuffer(L, utf.c_str(), utf.size(), "@code") != 0) {
+		chunk_stats.load_errors++;
+		return false;
+	}
+	if (chunk_capacity == 0 || !use_cache)
+		return true;
+
+	while (chunk_lru.size() >= chunk_capacity)
+		chunk_cache_evict_lru();
+	lua_pushvalue(L, -1);
+	const int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	chunk_lru.push_front(CachedChunk{ hash, utf, ref });
+	chunk_map.emplace(hash, chunk_lru.begin());
+	return true;
+}
+
+// Run a chunk with the table at env_index as its environment, and return its
+// first result. The environment of a cached chunk is set on every run, so
+// nested runs (from a callback) load a private copy instead.
+static int run_depth = 0;
+static Variant run_chunk(const std::string &utf, int env_index) {
+	if (!push_chunk(utf, run_depth == 0)) {
+		log_channel.printf("Lua load error: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return Nil;
+	}
+	lua_pushvalue(L, env_index);
+	lua_setfenv(L, -2);
+
+	// Run the script (0 arguments, 1 result)
+	run_depth++;
+	const int status = lua_pcall(L, 0, 1, 0);
+	run_depth--;
+	if (status != 0) {
+		log_channel.printf("Lua error: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return Nil;
+	}
+
+	// Convert the result, including tables
+	Variant result = lua_to_variant(L, -1);
+	lua_pop(L, 1);
+	return result;
+}
+
 static Variant run(String code) {
-	// Load a string as a script
+	LogFlushGuard flush_guard;
+	ensure_state();
+	// Load a string as a script, or fetch it from the chunk cache
+	return run_chunk(code.utf8(), LUA_GLOBALSINDEX);
+}
+
+// Isolated script states. Each state is an environment table which falls back
+// to the shared globals (libraries and registered functions) for reads, so the
+// base is set up once and global assignments stay inside the state. The
+// library tables themselves (string, math, ...) are shared, not copied: a
+// script which modifies them affects every state.
+static constexpr const char *STATE_METATABLE = "godot.state";
+static std::unordered_map<int64_t, int> state_refs; // State id -> registry reference
+static int64_t next_state_id = 1;
+static void kill_state_tasks(int64_t state);
+
+static Variant create_state() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	lua_newtable(L);
+	luaL_getmetatable(L, STATE_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "_G");
+	state_refs.emplace(next_state_id, luaL_ref(L, LUA_REGISTRYINDEX));
+	return next_state_id++;
+}
+
+// Stop the tasks of a state and drop the event handlers defined in it, so that
+// nothing from it runs once it is gone. Environment tables are never reused:
+// a function from the state which is still stored somewhere else keeps its own
+// table alive, and cannot see into a later state.
+static Variant destroy_state(int64_t state) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	auto it = state_refs.find(state);
+	if (it == state_refs.end())
+		return false;
+
+	kill_state_tasks(state);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, it->second);
+	events_remove_handlers(L, lua_gettop(L));
+	lua_pop(L, 1);
+
+	luaL_unref(L, LUA_REGISTRYINDEX, it->second);
+	state_refs.erase(it);
+	return true;
+}
+
+static Variant run_in(int64_t state, String code) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	auto it = state_refs.find(state);
+	if (it == state_refs.end()) {
+		log_channel.printf("run_in: no such state %lld\n", (long long)state);
+		return Nil;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, it->second);
+	Variant result = run_chunk(code.utf8(), lua_gettop(L));
+	lua_pop(L, 1);
+	return result;
+}
+
+static Variant state_stats() {
+	LogFlushGuard flush_guard;
+	Dictionary stats = Dictionary::Create();
+	stats.set("live", int64_t(state_refs.size()));
+	return stats;
+}
+
+// Scheduled tasks. Each task runs as a coroutine, and tick() resumes them
+// round-robin within an instruction budget, enforced by a count hook which
+// yields the running task when the budget runs out. Note that LuaJIT only
+// calls hooks from interpreted code, so a hot compiled loop is only
+// interrupted when it leaves its trace.
+struct Task {
+	int64_t id;
+	lua_State *thread;
+	int ref;       // Keeps the thread alive
+	int64_t wait;  // Ticks to sleep before resuming
+	int64_t state; // Isolated state the task runs in, or 0
+};
+static std::list<Task> tasks;
+static std::list<Task>::iterator next_task = tasks.end();
+static Task *current_task = nullptr;
+static int64_t next_task_id = 1;
+static int64_t tick_budget = 0;
+static bool budget_exhausted = false;
+static constexpr int HOOK_GRANULARITY = 1000;
+
+// Count hooks are global in LuaJIT, so the scheduler, the profiler and
+// allocation tracking share a single hook. It is only installed while one of
+// them needs it, and called every hook_count instructions.
+static bool scheduler_active = false;
+static bool profiling_hook = false;
+static bool alloc_tracking = false;
+static constexpr int ALLOC_SAMPLE_INTERVAL = 100;
+static int profile_interval = 0;
+static int profile_accumulated = 0;
+static int hook_count = 0;
+
+// Allocation sites: the bytes allocated since the previous sample are
+// attributed to the line running now, as "file:line". Hooks run between
+// instructions, where the stack can safely be inspected.
+static void sample_allocation_site(lua_State *co, lua_Debug *ar) {
+	if (lua_getinfo(co, "Sl", ar) && ar->currentline > 0) {
+		char site[256];
+		snprintf(site, sizeof(site), "%s:%d", ar->short_src, ar->currentline);
+		lua_alloc_attribute(site);
+	}
+}
+
+static void hook_dispatch(lua_State *co, lua_Debug *ar) {
+	if (ar->event != LUA_HOOKCOUNT)
+		return;
+	if (alloc_tracking)
+		sample_allocation_site(co, ar);
+	if (profiling_hook) {
+		profile_accumulated += hook_count;
+		if (profile_accumulated >= profile_interval) {
+			profile_accumulated = 0;
+			profiler_sample_hook(co, ar);
+		}
+	}
+	// Only the task being resumed may be yielded, not a nested run() on the main thread.
+	// Inside a call from C (a table.sort comparator, a metamethod) the task cannot
+	// yield: the budget stays negative and it yields at the next hook which can.
+	if (scheduler_active && current_task != nullptr && current_task->thread == co) {
+		tick_budget -= hook_count;
+		if (tick_budget <= 0 && lua_isyieldable(co)) {
+			budget_exhausted = true;
+			lua_yield(co, 0);
+		}
+	}
+}
+
+static void update_hook() {
+	int count = scheduler_active ? HOOK_GRANULARITY : 0;
+	if (profiling_hook)
+		count = count ? std::min(count, profile_interval) : profile_interval;
+	if (alloc_tracking)
+		count = count ? std::min(count, ALLOC_SAMPLE_INTERVAL) : ALLOC_SAMPLE_INTERVAL;
+	hook_count = count;
+	if (count > 0)
+		lua_sethook(L, hook_dispatch, LUA_MASKCOUNT, count);
+	else
+		lua_sethook(L, nullptr, 0, 0);
+}
+
+// wait(ticks): suspend the current task for the given number of ticks
+static int api_wait(lua_State *co) {
+	if (current_task == nullptr || current_task->thread != co)
+		return luaL_error(co, "wait() can only be called from a scheduled task");
+	current_task->wait = luaL_optinteger(co, 1, 0);
+	return lua_yield(co, 0);
+}
+
+// yield(): give up the rest of this tick
+static int api_yield(lua_State *co) {
+	if (current_task == nullptr || current_task->thread != co)
+		return luaL_error(co, "yield() can only be called from a scheduled task");
+	current_task->wait = 0;
+	return lua_yield(co, 0);
+}
+
+static std::list<Task>::iterator remove_task(std::list<Task>::iterator it) {
+	luaL_unref(L, LUA_REGISTRYINDEX, it->ref);
+	if (next_task == it)
+		++next_task;
+	return tasks.erase(it);
+}
+
+// spawn(code, state): run code as a scheduled task, in the globals
+// (state 0) or in an isolated state. Returns the task id, or 0 on error.
+static Variant spawn(String code, int64_t state) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	int env_ref = LUA_NOREF;
+	if (state != 0) {
+		auto it = state_refs.find(state);
+		if (it == state_refs.end()) {
+			log_channel.printf("spawn: no such state %lld\n", (long long)state);
+			return 0;
+		}
+		env_ref = it->second;
+	}
+
+	// Tasks outlive the call, so they get a private copy of the chunk: the
+	// environment of a cached chunk changes whenever it is run.
 	const std::string utf = code.utf8();
-	luaL_loadbuffer(L, utf.c_str(), utf.size(), "@code");
+	if (!push_chunk(utf, false)) {
+		log_channel.printf("Lua load error: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return 0;
+	}
+	if (env_ref != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, env_ref);
+		lua_setfenv(L, -2);
+	}
 
-	// Run the script (0 arguments, 1 result)
-	lua_pcall(L, 0, 1, 0);
+	lua_State *thread = lua_newthread(L);
+	const int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_xmove(L, thread, 1); // Move the chunk to the new thread
+	tasks.push_back(Task{ next_task_id, thread, ref, 0, state });
+	return next_task_id++;
+}
 
-	// Get the result type
-	const int type = lua_type(L, -1);
-	switch (type) {
-		case LUA_TNIL:
+// A task which is running right now finishes on its own
+static void kill_state_tasks(int64_t state) {
+	for (auto it = tasks.begin(); it != tasks.end();) {
+		if (it->state == state && &*it != current_task)
+			it = remove_task(it);
+		else
+			++it;
+	}
+}
+
+static Variant kill(int64_t task) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+		if (it->id == task) {
+			if (&*it == current_task)
+				return false; // A task cannot kill itself, it can return instead
+			remove_task(it);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Resume runnable tasks until each has run once this tick, or the instruction
+// budget is spent. The next tick continues with the task after the last one.
+static Variant tick(int64_t budget) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	tick_budget = budget;
+	budget_exhausted = false;
+	int64_t resumed = 0, finished = 0, failed = 0;
+	scheduler_active = true;
+	update_hook();
+
+	size_t remaining = tasks.size();
+	while (remaining-- > 0 && tick_budget > 0 && !tasks.empty()) {
+		if (next_task == tasks.end())
+			next_task = tasks.begin();
+		auto it = next_task;
+		next_task = std::next(it) == tasks.end() ? tasks.begin() : std::next(it);
+		if (it->wait > 0) {
+			it->wait--;
+			continue;
+		}
+
+		current_task = &*it;
+		budget_exhausted = false;
+		const int status = lua_resume(it->thread, 0);
+		current_task = nullptr;
+		resumed++;
+
+		if (status == LUA_YIELD) {
+			lua_settop(it->thread, 0);
+			if (budget_exhausted)
+				break; // Resume this task first next tick
+			continue;
+		}
+		if (status != 0) {
+			log_channel.printf("Lua task %lld error: %s\n", (long long)it->id, lua_tostring(it->thread, -1));
+			failed++;
+		} else {
+			finished++;
+		}
+		remove_task(it);
+	}
+	scheduler_active = false;
+	update_hook();
+	if (budget_exhausted && !tasks.empty()) {
+		// The interrupted task goes first next time
+		next_task = next_task == tasks.begin() ? std::prev(tasks.end()) : std::prev(next_task);
+	}
+
+	Dictionary result = Dictionary::Create();
+	result.set("resumed", resumed);
+	result.set("finished", finished);
+	result.set("failed", failed);
+	result.set("tasks", int64_t(tasks.size()));
+	result.set("budget_left", tick_budget > 0 ? tick_budget : int64_t(0));
+	return result;
+}
+
+// Libraries which were opened but not selected, by module name. They are
+// removed from package.loaded and package.preload, so scripts cannot
+// require() them, but the program's own helper chunks still use them.
+static constexpr const char *HIDDEN_MODULES = "luajit.hidden_modules";
+
+// require() for helper chunks, which also finds hidden libraries. Hidden
+// submodules are kept as their preload function until first use.
+static int internal_require(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, HIDDEN_MODULES);
+	lua_getfield(L, -1, name);
+	if (lua_isfunction(L, -1)) {
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 1);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, name);
+	}
+	if (!lua_isnil(L, -1))
+		return 1;
+	lua_settop(L, 1);
+	lua_getglobal(L, "require");
+	lua_insert(L, 1);
+	lua_call(L, 1, 1);
+	return 1;
+}
+
+// Load and run a helper chunk, which receives internal_require as `...`
+static bool run_helper(const char *source, size_t size, const char *name, int nresults) {
+	if (luaL_loadbuffer(L, source, size, name) != 0)
+		return false;
+	lua_pushcfunction(L, internal_require);
+	return lua_pcall(L, 1, nresults, 0) == 0;
+}
+
+// Profiling. The default mode samples from the count hook every `interval`
+// instructions, which works with or without the JIT. The "jit" mode uses
+// jit.profile, sampling every `interval` milliseconds including compiled code,
+// where the platform supports its timer.
+static const char PROFILE_JIT_SOURCE[] = R"(
+local require = ...
+local profile = require("jit.profile")
+local lines, functions, stacks = {}, {}, {}
+local function sample(thread, samples)
+	local l = profile.dumpstack(thread, "pl", 1)
+	lines[l] = (lines[l] or 0) + samples
+	local f = profile.dumpstack(thread, "pF", 1)
+	functions[f] = (functions[f] or 0) + samples
+	local s = profile.dumpstack(thread, "pF;", -16)
+	stacks[s] = (stacks[s] or 0) + samples
+end
+local function start(interval)
+	lines, functions, stacks = {}, {}, {}
+	profile.start("li" .. interval, sample)
+end
+local function stop()
+	profile.stop()
+	return lines, functions, stacks
+end
+return start, stop
+)";
+static int profile_jit_stop_ref = LUA_NOREF;
+static bool profiling_jit = false;
+
+static bool profile_jit_start(int interval) {
+	if (profile_jit_stop_ref == LUA_NOREF) {
+		if (!run_helper(PROFILE_JIT_SOURCE, sizeof(PROFILE_JIT_SOURCE) - 1, "=profile", 2)) {
+			log_channel.printf("jit.profile is not available (%s), using the count hook\n", lua_tostring(L, -1));
+			lua_pop(L, 1);
+			return false;
+		}
+		profile_jit_stop_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_setfield(L, LUA_REGISTRYINDEX, "godot.profile_start");
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, "godot.profile_start");
+	lua_pushinteger(L, interval);
+	if (lua_pcall(L, 1, 0, 0) != 0) {
+		log_channel.printf("jit.profile failed to start (%s), using the count hook\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return false;
+	}
+	return true;
+}
+
+// profile_start(interval, mode): mode is "" (count hook, interval in
+// instructions) or "jit" (jit.profile, interval in milliseconds)
+static Variant profile_start(int interval, String mode) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (profiling_hook || profiling_jit) {
+		log_channel.printf("The profiler is already running\n");
+		return false;
+	}
+	profiler_reset();
+	if (mode.utf8() == "jit" && profile_jit_start(interval > 0 ? interval : 1)) {
+		profiling_jit = true;
+		return true;
+	}
+	profile_interval = interval > 0 ? interval : 1000;
+	profile_accumulated = 0;
+	profiling_hook = true;
+	update_hook();
+	return true;
+}
+
+static Variant profile_stop() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (profiling_jit) {
+		profiling_jit = false;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, profile_jit_stop_ref);
+		if (lua_pcall(L, 0, 3, 0) != 0) {
+			log_channel.printf("jit.profile failed to stop: %s\n", lua_tostring(L, -1));
+			lua_pop(L, 1);
 			return Nil;
-		case LUA_TBOOLEAN:
-			return lua_toboolean(L, -1);
-		case LUA_TNUMBER:
-			return lua_tonumber(L, -1);
-		case LUA_TSTRING:
-			return lua_tostring(L, -1);
+		}
+		const int top = lua_gettop(L);
+		for (int which = 0; which < 3; which++) {
+			profiler_merge_table(L, top - 2 + which, which);
+		}
+		lua_pop(L, 3);
+		return profiler_results("jit", 20);
+	}
+	if (profiling_hook) {
+		profiling_hook = false;
+		update_hook();
+		return profiler_results("hook", 20);
+	}
+	return Nil;
+}
+
+// JIT trace diagnostics, from jit.attach. Keeps event counts, the last N
+// events in a ring buffer and abort counts per location and reason, so that
+// scripts which never get compiled can be found.
+static const char JIT_DIAG_SOURCE[] = R"(
+local require = ...
+local jit = require("jit")
+local jutil = require("jit.util")
+local ok, vmdef = pcall(require, "jit.vmdef")
+local capacity, head, events = 64, 0, {}
+local counts, aborts, reasons = {}, {}, {}
+
+local function location(func, pc)
+	local fi = jutil.funcinfo(func, pc)
+	return fi.loc or "?"
+end
+local function reason(err, info)
+	if type(err) == "number" then
+		local fmt = ok and vmdef.traceerr[err]
+		if not fmt then return "error " .. err end
+		if type(info) == "function" then info = location(info) end
+		local fok, msg = pcall(string.format, fmt, info)
+		return fok and msg or fmt
+	end
+	return tostring(err)
+end
+local function record(event)
+	head = head % capacity + 1
+	events[head] = event
+end
+local function on_trace(what, tr, func, pc, otr, oex)
+	counts[what] = (counts[what] or 0) + 1
+	if what == "flush" then
+		record({ event = what })
+		return
+	end
+	local loc = location(func, pc)
+	if what == "abort" then
+		local why = reason(otr, oex)
+		aborts[loc] = (aborts[loc] or 0) + 1
+		reasons[why] = (reasons[why] or 0) + 1
+		record({ event = what, trace = tr, location = loc, reason = why })
+	else
+		record({ event = what, trace = tr, location = loc })
+	end
+end
+
+local diag = {}
+function diag.start(max_events)
+	capacity = max_events > 0 and max_events or 64
+	head, events, counts, aborts, reasons = 0, {}, {}, {}, {}
+	jit.attach(on_trace, "trace")
+end
+function diag.stop()
+	jit.attach(on_trace)
+end
+function diag.report()
+	local ordered = {}
+	local n = #events
+	for i = 1, n do
+		-- Oldest first: once the buffer has wrapped, the oldest follows head
+		ordered[i] = events[n < capacity and i or (head + i - 1) % capacity + 1]
+	end
+	return { counts = counts, events = ordered, aborts_by_location = aborts, aborts_by_reason = reasons }
+end
+function diag.set_options(options)
+	local args = {}
+	for k, v in pairs(options) do
+		if k == "enabled" then
+			if v then jit.on() else jit.off() end
+		elseif type(v) == "boolean" then
+			args[#args + 1] = (v and "+" or "-") .. k
+		else
+			args[#args + 1] = k .. "=" .. tostring(v)
+		end
+	end
+	-- jit.opt.start() without arguments resets every option to its default
+	if #args > 0 then
+		jit.opt.start(unpack(args))
+	end
+end
+
+-- Machine code: one area of size_kb, allocated up front by compiling a trace.
+-- A flush unmaps the area, and the next trace which is compiled maps a new one.
+local mcode = { size_kb = 0, flushes = 0, remaps = 0, traces = 0, unmapped = false }
+local function on_mcode_trace(what)
+	if what == "flush" then
+		mcode.flushes = mcode.flushes + 1
+		mcode.unmapped = true
+	elseif what == "stop" then
+		mcode.traces = mcode.traces + 1
+		if mcode.unmapped then
+			mcode.remaps = mcode.remaps + 1
+			mcode.unmapped = false
+		end
+	end
+end
+function diag.configure_mcode(size_kb)
+	jit.flush()
+	jit.opt.start("sizemcode=" .. size_kb, "maxmcode=" .. size_kb)
+	mcode.size_kb, mcode.flushes, mcode.remaps, mcode.traces, mcode.unmapped = size_kb, 0, 0, 0, false
+	jit.attach(on_mcode_trace)
+	jit.attach(on_mcode_trace, "trace")
+	local x = 0
+	for i = 1, 1000 do
+		x = x + i
+	end
+	return x
+end
+function diag.mcode_stats()
+	local bytes, traces, misses, tr = 0, 0, 0, 1
+	-- Trace numbers can have gaps, stop after a run of unused ones
+	while misses < 64 do
+		local mc = jutil.traceinfo(tr) and jutil.tracemc(tr)
+		if mc then
+			bytes, traces, misses = bytes + #mc, traces + 1, 0
+		else
+			misses = misses + 1
+		end
+		tr = tr + 1
+	end
+	return { size_kb = mcode.size_kb, used_bytes = bytes, live_traces = traces,
+		compiled_traces = mcode.traces, flushes = mcode.flushes, remaps = mcode.remaps }
+end
+return diag
+)";
+static int jit_diag_ref = LUA_NOREF;
+
+// Push the diagnostics function with the given name, loading the helper on first use
+static bool push_jit_diag(const char *name) {
+	if (jit_diag_ref == LUA_NOREF) {
+		if (!run_helper(JIT_DIAG_SOURCE, sizeof(JIT_DIAG_SOURCE) - 1, "=jit_diag", 1)) {
+			log_channel.printf("JIT diagnostics are not available: %s\n", lua_tostring(L, -1));
+			lua_pop(L, 1);
+			return false;
+		}
+		jit_diag_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, jit_diag_ref);
+	lua_getfield(L, -1, name);
+	lua_remove(L, -2);
+	return true;
+}
+
+// Call a diagnostics function with the arguments on top of the stack, leaving nresults
+static bool call_jit_diag(const char *name, int nargs, int nresults) {
+	if (!push_jit_diag(name)) {
+		lua_pop(L, nargs);
+		return false;
+	}
+	lua_insert(L, -(nargs + 1));
+	if (lua_pcall(L, nargs, nresults, 0) != 0) {
+		log_channel.printf("jit_diag.%s: %s\n", name, lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return false;
+	}
+	return true;
+}
+
+static Variant jit_trace_start(int max_events) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	lua_pushinteger(L, max_events);
+	return call_jit_diag("start", 1, 0);
+}
+
+static Variant jit_trace_stop() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	return call_jit_diag("stop", 0, 0);
+}
+
+static Variant jit_trace_report() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (!call_jit_diag("report", 0, 1))
+		return Nil;
+	Variant result = lua_to_variant(L, -1);
+	lua_pop(L, 1);
+	return result;
+}
+
+// Options are passed to jit.opt.start(): numbers as "key=value" (hotloop,
+// maxtrace, maxmcode, ...), booleans as optimization flags ("+fold"/"-fold"),
+// and "enabled" turns the JIT on or off.
+static Variant set_jit_options(Dictionary options) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (push_variant(L, options) == 0)
+		lua_newtable(L);
+	return call_jit_diag("set_options", 1, 0);
+}
+
+// Reserve one machine code area of size_kb for all traces (sizemcode =
+// maxmcode), and allocate it now by compiling a warm-up trace. Each mcode area
+// is an executable mapping, which is expensive in the emulator. When the area
+// is full, LuaJIT flushes all traces, which also unmaps every area
+// (lj_mcode_clear), and the next trace maps a new one: each flush costs a
+// remap, counted in mcode_stats(). Existing traces are flushed.
+static Variant configure_mcode(int size_kb) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (size_kb <= 0)
+		return false;
+	lua_pushinteger(L, size_kb);
+	return call_jit_diag("configure_mcode", 1, 0);
+}
+
+static Variant mcode_stats() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (!call_jit_diag("mcode_stats", 0, 1))
+		return Nil;
+	Variant result = lua_to_variant(L, -1);
+	lua_pop(L, 1);
+	return result;
+}
+
+// Output from print() is buffered, see log_channel.hpp
+static Variant flush_output() {
+	log_channel.flush();
+	return Nil;
+}
+
+static Variant set_output_options(int threshold, bool to_godot) {
+	LogFlushGuard flush_guard;
+	log_channel.set_threshold(std::max(threshold, 0));
+	log_channel.set_to_godot(to_godot);
+	return Nil;
+}
+
+static Variant cache_stats() {
+	LogFlushGuard flush_guard;
+	Dictionary stats = Dictionary::Create();
+	stats.set("hits", int64_t(chunk_stats.hits));
+	stats.set("misses", int64_t(chunk_stats.misses));
+	stats.set("evictions", int64_t(chunk_stats.evictions));
+	stats.set("load_errors", int64_t(chunk_stats.load_errors));
+	stats.set("entries", int64_t(chunk_lru.size()));
+	stats.set("capacity", int64_t(chunk_capacity));
+	return stats;
+}
+
+static Variant set_cache_capacity(int capacity) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	chunk_capacity = capacity > 0 ? capacity : 0;
+	while (chunk_lru.size() > chunk_capacity)
+		chunk_cache_evict_lru();
+	return Nil;
+}
+
+// Lua -> Godot callbacks. A signature is a string of argument type codes,
+// optionally followed by ':' and the return type code:
+//   b = bool, i = int, f = float, s = String, v = any (converted by Lua type)
+// For example "fs:f" takes a float and a String, and returns a float.
+// An empty signature accepts any number of arguments of any type.
+static constexpr size_t MAX_SIGNATURE_ARGS = 32;
+static constexpr const char *CALLBACK_METATABLE = "godot.callback";
+struct Callback {
+	Variant function;
+	bool variadic;
+	uint8_t nargs;
+	char ret;
+	char args[MAX_SIGNATURE_ARGS];
+};
+
+// Argument buffer shared by all callbacks. Nested calls (a callback which
+// runs Lua which calls another callback) use the space above the caller.
+static constexpr size_t ARG_STACK_SIZE = 256;
+static Variant arg_stack[ARG_STACK_SIZE];
+static size_t arg_stack_top = 0;
+
+static bool parse_signature(const std::string &signature, Callback &cb) {
+	cb.variadic = signature.empty();
+	cb.nargs = 0;
+	cb.ret = 'v';
+	size_t i = 0;
+	for (; i < signature.size() && signature[i] != ':'; i++) {
+		if (cb.nargs == MAX_SIGNATURE_ARGS || !strchr("bifsv", signature[i]))
+			return false;
+		cb.args[cb.nargs++] = signature[i];
+	}
+	if (i < signature.size()) {
+		if (i + 2 != signature.size() || !strchr("bifsv", signature[i + 1]))
+			return false;
+		cb.ret = signature[i + 1];
+	}
+	return true;
+}
+
+// Convert the Lua value at index idx into a Variant, in place
+static void to_variant(lua_State *L, int idx, char type, Variant &out) {
+	switch (type) {
+		case 'b':
+			out = bool(lua_toboolean(L, idx));
+			return;
+		case 'i':
+			out = int64_t(luaL_checkinteger(L, idx));
+			return;
+		case 'f':
+			out = double(luaL_checknumber(L, idx));
+			return;
+		case 's': {
+			size_t len;
+			const char *str = luaL_checklstring(L, idx, &len);
+			out = String(std::string_view(str, len));
+			return;
+		}
 		default:
-			return Nil;
+			break;
+	}
+	out = lua_to_variant(L, idx);
+}
+
+static int callback_trampoline(lua_State *L) {
+	Callback *cb = (Callback *)lua_touserdata(L, lua_upvalueindex(1));
+	const int nargs = lua_gettop(L);
+	if (!cb->variadic && nargs != cb->nargs)
+		return luaL_error(L, "expected %d arguments, got %d", int(cb->nargs), nargs);
+	if (arg_stack_top + nargs > ARG_STACK_SIZE)
+		return luaL_error(L, "callback argument stack overflow");
+
+	Variant *args = &arg_stack[arg_stack_top];
+	for (int i = 0; i < nargs; i++) {
+		to_variant(L, i + 1, cb->variadic ? 'v' : cb->args[i], args[i]);
+	}
+	if constexpr (VERBOSE) {
+		log_channel.printf("Calling function with %d arguments\n", nargs);
+	}
+
+	arg_stack_top += nargs;
+	Variant result;
+	cb->function.callp("call", args, nargs, result);
+	arg_stack_top -= nargs;
+
+	switch (cb->ret) {
+		case 'b':
+			lua_pushboolean(L, bool(result));
+			return 1;
+		case 'i':
+			lua_pushinteger(L, int64_t(result));
+			return 1;
+		case 'f':
+			lua_pushnumber(L, double(result));
+			return 1;
+		default:
+			return push_variant(L, result);
 	}
 }
 
+static int callback_gc(lua_State *L) {
+	Callback *cb = (Callback *)lua_touserdata(L, 1);
+	cb->~Callback();
+	return 0;
+}
+
+static bool register_callback(const std::string &name, const Callable &function, const std::string &signature) {
+	// The Callback is a full userdata, owned by the closure which uses it
+	Callback *cb = new (lua_newuserdata(L, sizeof(Callback))) Callback();
+	if (!parse_signature(signature, *cb)) {
+		cb->~Callback();
+		lua_pop(L, 1);
+		log_channel.printf("Invalid callback signature '%s' for %s\n", signature.c_str(), name.c_str());
+		return false;
+	}
+	luaL_getmetatable(L, CALLBACK_METATABLE);
+	lua_setmetatable(L, -2);
+	// Make sure the function is not garbage collected
+	cb->function = function;
+	cb->function.make_permanent();
+
+	lua_pushcclosure(L, callback_trampoline, 1);
+	lua_setglobal(L, name.c_str());
+	return true;
+}
+
+static Variant set_pack_numeric_tables(bool enable) {
+	LogFlushGuard flush_guard;
+	convert_set_pack_numeric(enable);
+	return Nil;
+}
+
 static Variant add_function(String function_name, Callable function) {
-	// Create a struct to store callback information
-	struct UserData {
-		Variant function;
-	};
-	UserData *data = new UserData;
-	// Make sure the function is not garbage collected, store it in the struct
-	data->function = function;
-	data->function.make_permanent();
-	// Push the function to the Lua stack
-	lua_pushlightuserdata(L, (void *)data);
-	lua_pushcclosure(L, [](lua_State *L) -> int {
-		UserData *data = (UserData *)lua_touserdata(L, lua_upvalueindex(1));
-		if constexpr (VERBOSE) {
-			printf("Calling function with Callable Variant type %d index %d\n",
-				data->function.get_type(), data->function.get_internal_index());
-		}
-		Variant &function = data->function;
-		// Create a fixed-size array to store the arguments
-		std::array<Variant, 8> args;
-		size_t arg_count = 0;
-		// Find the number of arguments
-		const int nargs = lua_gettop(L);
-		for (int i = 1; i <= nargs; i++) {
-			// Push the arguments to the vector
-			switch (lua_type(L, i)) {
-				case LUA_TNIL:
-					break;
-				case LUA_TBOOLEAN:
-					if constexpr (VERBOSE)
-						printf("Boolean argument %d\n", lua_toboolean(L, i));
-					args.at(arg_count++) = bool(lua_toboolean(L, i));
-					break;
-				case LUA_TNUMBER:
-					if constexpr (VERBOSE)
-						printf("Number argument %f\n", lua_tonumber(L, i));
-					args.at(arg_count++) = double(lua_tonumber(L, i));
-					break;
-				case LUA_TSTRING:
-					if constexpr (VERBOSE)
-						printf("String argument %s\n", lua_tostring(L, i));
-					args.at(arg_count++) = lua_tostring(L, i);
-					break;
-				default:
-					if constexpr (VERBOSE)
-						printf("Unknown argument type %d\n", lua_type(L, i));
-					break;
+	LogFlushGuard flush_guard;
+	ensure_state();
+	register_callback(function_name.utf8(), function, "");
+	return Nil;
+}
+
+static Variant add_typed_function(String function_name, Callable function, String signature) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	return register_callback(function_name.utf8(), function, signature.utf8());
+}
+
+// Measure the cost of calling a registered function from Lua, compared with a
+// Lua function taking the same arguments. The registered Godot function really
+// is called `iterations` times, with zero values (false, 0, "") for typed
+// arguments, so it should be free of side effects. An error stops the run.
+static Variant benchmark_callback(String function_name, int iterations) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	const std::string name = function_name.utf8();
+	lua_getglobal(L, name.c_str());
+	const Callback *cb = nullptr;
+	if (lua_iscfunction(L, -1) && lua_getupvalue(L, -1, 1) != nullptr) {
+		if (lua_getmetatable(L, -1)) {
+			luaL_getmetatable(L, CALLBACK_METATABLE);
+			if (lua_rawequal(L, -1, -2))
+				cb = (const Callback *)lua_touserdata(L, -3);
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 1);
+	}
+	if (cb == nullptr) {
+		lua_pop(L, 1);
+		log_channel.printf("%s is not a registered function\n", name.c_str());
+		return Nil;
+	}
+	const int nargs = cb->variadic ? 0 : cb->nargs;
+
+	luaL_loadstring(L, "return function() end");
+	lua_call(L, 0, 1);
+
+	// Returns -1 if a call fails
+	auto measure = [&](int fidx) -> double {
+		const int top = lua_gettop(L);
+		const auto t0 = std::chrono::steady_clock::now();
+		for (int n = 0; n < iterations; n++) {
+			lua_pushvalue(L, fidx);
+			for (int i = 0; i < nargs; i++) {
+				switch (cb->args[i]) {
+					case 'b':
+						lua_pushboolean(L, 0);
+						break;
+					case 's':
+						lua_pushliteral(L, "");
+						break;
+					default:
+						lua_pushnumber(L, 0);
+						break;
+				}
+			}
+			if (lua_pcall(L, nargs, 0, 0) != 0) {
+				log_channel.printf("benchmark_callback: %s\n", lua_tostring(L, -1));
+				lua_settop(L, top);
+				return -1.0;
 			}
 		}
-		if constexpr (VERBOSE) {
-			printf("Calling function with %zu arguments\n", arg_count);
-			for (size_t i = 0; i < arg_count; i++) {
-				printf("Argument %zu type %d\n", i, args.at(i).get_type());
+		const auto t1 = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::nano>(t1 - t0).count() / std::max(iterations, 1);
+	};
+	const double callback_ns = measure(lua_gettop(L) - 1);
+	const double baseline_ns = callback_ns >= 0 ? measure(lua_gettop(L)) : -1.0;
+	lua_pop(L, 2);
+	if (callback_ns < 0 || baseline_ns < 0)
+		return Nil;
+
+	Dictionary result = Dictionary::Create();
+	result.set("ns_per_call", callback_ns);
+	result.set("baseline_ns_per_call", baseline_ns);
+	result.set("overhead_ns_per_call", callback_ns - baseline_ns);
+	result.set("iterations", iterations);
+	return result;
+}
+
+// Make a Godot object available to Lua as a global, see the godot module
+static Variant bind_object(String name, Variant object) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (object.get_type() != Variant::Type::OBJECT)
+		return false;
+	godot_push_object(L, object);
+	lua_setglobal(L, name.utf8().c_str());
+	return true;
+}
+
+static Variant connect_event(Variant object, String signal, String event_name) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (object.get_type() != Variant::Type::OBJECT)
+		return -1;
+	return events_connect(object, signal.utf8(), event_name.utf8());
+}
+
+static Variant dispatch_events() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	return events_dispatch(L);
+}
+
+static Variant event_stats() {
+	LogFlushGuard flush_guard;
+	return events_stats();
+}
+
+static Variant bind_view(String name, Variant packed) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	return view_bind(L, name.utf8(), packed);
+}
+
+static Variant commit_view(String name) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	return view_commit(name.utf8());
+}
+
+static Variant release_view(String name) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	return view_release(L, name.utf8());
+}
+
+// Batch calls. The loop over the argument tuples runs in Lua, over FFI
+// pointers into the argument and result buffers, so that LuaJIT can compile
+// it together with the function. A driver is generated once per stride. When
+// the ffi library is not available, the loop runs in C instead.
+static constexpr int BATCH_MAX_UNROLLED_STRIDE = 32;
+static const char BATCH_DRIVER_SOURCE[] = R"(
+local ffi = require("ffi")
+local float_ptr = ffi.typeof("float *")
+local drivers = {}
+return function(f, args, out, n, stride)
+	local driver = drivers[stride]
+	if not driver then
+		local params = {}
+		for j = 0, stride - 1 do
+			params[#params + 1] = "a[b + " .. j .. "]"
+		end
+		driver = loadstring("return function(f, a, o, n) for i = 0, n - 1 do local b = i * " .. stride ..
+			"; o[i] = f(" .. table.concat(params, ", ") .. ") end end", "=call_batch")()
+		drivers[stride] = driver
+	end
+	driver(f, ffi.cast(float_ptr, args), ffi.cast(float_ptr, out), n)
+end
+)";
+static int batch_driver_ref = LUA_NOREF;
+static bool batch_driver_failed = false;
+
+static bool push_batch_driver() {
+	if (batch_driver_ref == LUA_NOREF) {
+		if (batch_driver_failed)
+			return false;
+		if (luaL_loadbuffer(L, BATCH_DRIVER_SOURCE, sizeof(BATCH_DRIVER_SOURCE) - 1, "=call_batch") != 0 || lua_pcall(L, 0, 1, 0) != 0) {
+			lua_pop(L, 1); // Without ffi, fall back to the C loop
+			batch_driver_failed = true;
+			return false;
+		}
+		batch_driver_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, batch_driver_ref);
+	return true;
+}
+
+// Call a global Lua function once per tuple of `stride` arguments, and return
+// its results (which must be numbers) as one packed array
+static Variant call_batch(String function_name, PackedArray<float> args, int stride) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (stride <= 0) {
+		log_channel.printf("call_batch: stride must be positive\n");
+		return Nil;
+	}
+	const std::string name = function_name.utf8();
+	lua_getglobal(L, name.c_str());
+	if (!lua_isfunction(L, -1)) {
+		lua_pop(L, 1);
+		log_channel.printf("call_batch: %s is not a function\n", name.c_str());
+		return Nil;
+	}
+	const int fidx = lua_gettop(L);
+
+	const std::vector<float> in = args.fetch();
+	const size_t n = in.size() / stride;
+	std::vector<float> out(n);
+
+	if (stride <= BATCH_MAX_UNROLLED_STRIDE && push_batch_driver()) {
+		lua_pushvalue(L, fidx);
+		lua_pushlightuserdata(L, (void *)in.data());
+		lua_pushlightuserdata(L, out.data());
+		lua_pushnumber(L, lua_Number(n));
+		lua_pushinteger(L, stride);
+		if (lua_pcall(L, 5, 0, 0) != 0) {
+			log_channel.printf("call_batch: %s\n", lua_tostring(L, -1));
+			lua_pop(L, 2);
+			return Nil;
+		}
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			lua_pushvalue(L, fidx);
+			for (int j = 0; j < stride; j++) {
+				lua_pushnumber(L, in[i * stride + j]);
 			}
-			fflush(stdout);
-		}
-		Variant result;
-		function.callp("call", args.data(), arg_count, result);
-		// Push the result to the Lua stack
-		switch (result.get_type()) {
-			case Variant::Type::NIL:
-				return 0;
-			case Variant::Type::BOOL:
-				lua_pushboolean(L, result);
-				return 1;
-			case Variant::Type::INT:
-			case Variant::Type::FLOAT:
-				lua_pushnumber(L, result);
-				return 1;
-			case Variant::Type::STRING:
-				lua_pushstring(L, result.as_std_string().c_str());
-				return 1;
-			default:
-				return 0;
-		}
-	}, 1);
-	lua_setglobal(L, function_name.utf8().c_str());
-	return Nil;
+			if (lua_pcall(L, stride, 1, 0) != 0) {
+				log_channel.printf("call_batch: %s\n", lua_tostring(L, -1));
+				lua_pop(L, 2);
+				return Nil;
+			}
+			out[i] = float(lua_tonumber(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	return PackedArray<float>(out);
+}
+
+static Variant alloc_tracking_start() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (!pool_allocator) {
+		log_channel.printf("Allocation tracking needs the pool allocator\n");
+		return false;
+	}
+	lua_alloc_visit_sites([](const char *, const LuaAllocSite &, void *) {}, nullptr, true);
+	lua_alloc_set_site_tracking(true);
+	alloc_tracking = true;
+	update_hook();
+	return true;
+}
+
+// Stop tracking, and return the allocation count and bytes per site, with the
+// sites allocating the most bytes first in "top"
+static Variant alloc_tracking_stop() {
+	LogFlushGuard flush_guard;
+	if (!alloc_tracking)
+		return Nil;
+	// Allocated after the last sample, or outside of Lua code
+	lua_alloc_attribute("(unattributed)");
+	lua_alloc_set_site_tracking(false);
+	alloc_tracking = false;
+	update_hook();
+	struct Site {
+		std::string name;
+		LuaAllocSite site;
+	};
+	std::vector<Site> all;
+	lua_alloc_visit_sites([](const char *name, const LuaAllocSite &site, void *user) {
+		((std::vector<Site> *)user)->push_back(Site{ name, site });
+	}, &all, true);
+	std::sort(all.begin(), all.end(), [](const Site &a, const Site &b) { return a.site.bytes > b.site.bytes; });
+
+	Dictionary sites = Dictionary::Create();
+	Array top = Array::Create();
+	for (size_t i = 0; i < all.size(); i++) {
+		Dictionary entry = Dictionary::Create();
+		entry.set("count", int64_t(all[i].site.count));
+		entry.set("bytes", int64_t(all[i].site.bytes));
+		if (i < 20) {
+			Dictionary ranked = Dictionary::Create();
+			ranked.set("site", String(all[i].name));
+			ranked.set("count", int64_t(all[i].site.count));
+			ranked.set("bytes", int64_t(all[i].site.bytes));
+			top.append(ranked);
+		}
+		sites.set(String(all[i].name), entry);
+	}
+	Dictionary result = Dictionary::Create();
+	result.set("sites", sites);
+	result.set("top", top);
+	return result;
+}
+
+// Walk everything reachable from the registry (which holds the globals, loaded
+// modules and all references) and summarize live objects by type. Sizes are
+// estimates from the visible contents. Suspended coroutines (scheduled tasks)
+// are followed through the functions and locals of their stack frames, but
+// temporaries between locals and the stack of the running thread are not
+// seen. Needs the debug library.
+static const char HEAP_SNAPSHOT_SOURCE[] = R"(
+local registry = debug.getregistry()
+local getupvalue, getmetatable, getfenv = debug.getupvalue, debug.getmetatable, debug.getfenv
+local getinfo, getlocal, running = debug.getinfo, debug.getlocal, coroutine.running()
+local seen, stack, n = { [registry] = true }, { registry }, 1
+local counts, bytes = {}, {}
+local function push(v)
+	local t = type(v)
+	if (t == "table" or t == "function" or t == "userdata" or t == "thread" or t == "string") and not seen[v] then
+		seen[v] = true
+		n = n + 1
+		stack[n] = v
+	end
+end
+while n > 0 do
+	local v = stack[n]
+	stack[n] = nil
+	n = n - 1
+	local t = type(v)
+	counts[t] = (counts[t] or 0) + 1
+	if t == "string" then
+		bytes[t] = (bytes[t] or 0) + 24 + #v
+	elseif t == "table" then
+		local size = 64
+		for k, val in next, v do
+			size = size + 24
+			push(k)
+			push(val)
+		end
+		bytes[t] = (bytes[t] or 0) + size
+	elseif t == "function" then
+		local i = 1
+		while true do
+			local name, up = getupvalue(v, i)
+			if name == nil then break end
+			push(up)
+			i = i + 1
+		end
+		bytes[t] = (bytes[t] or 0) + 40 + 8 * (i - 1)
+	elseif t == "thread" and v ~= running then
+		local level = 0
+		while getinfo(v, level, "f") do
+			push(getinfo(v, level, "f").func)
+			local i = 1
+			while true do
+				local name, value = getlocal(v, level, i)
+				if name == nil then break end
+				push(value)
+				i = i + 1
+			end
+			level = level + 1
+		end
+	end
+	if t ~= "string" then
+		push(getmetatable(v))
+		if t ~= "table" then push(getfenv(v)) end
+	end
+end
+seen = nil
+return { counts = counts, bytes_estimate = bytes }
+)";
+
+static Variant heap_snapshot() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	if (luaL_loadbuffer(L, HEAP_SNAPSHOT_SOURCE, sizeof(HEAP_SNAPSHOT_SOURCE) - 1, "=heap_snapshot") != 0 || lua_pcall(L, 0, 1, 0) != 0) {
+		log_channel.printf("heap_snapshot: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return Nil;
+	}
+	Variant result = lua_to_variant(L, -1);
+	lua_pop(L, 1);
+	return result;
+}
+
+static Variant memory_stats() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	const LuaAllocStats &stats = lua_alloc_stats();
+	Dictionary result = Dictionary::Create();
+	result.set("pool_allocator", pool_allocator);
+	result.set("lua_kb", lua_gc(L, LUA_GCCOUNT, 0) + lua_gc(L, LUA_GCCOUNTB, 0) / 1024.0);
+	if (pool_allocator) {
+		result.set("bytes", int64_t(stats.bytes));
+		result.set("peak_bytes", int64_t(stats.peak_bytes));
+		result.set("arena_bytes", int64_t(stats.arena_bytes));
+		result.set("large_bytes", int64_t(stats.large_bytes));
+		result.set("large_allocs", int64_t(stats.large_allocs));
+		result.set("total_allocs", int64_t(stats.total_allocs));
+		result.set("total_frees", int64_t(stats.total_frees));
+		Array classes = Array::Create();
+		for (size_t i = 0; i < LUA_ALLOC_NUM_CLASSES; i++) {
+			Dictionary cls = Dictionary::Create();
+			cls.set("size", int64_t(lua_alloc_class_size(i)));
+			cls.set("live", int64_t(stats.class_live[i]));
+			cls.set("total", int64_t(stats.class_total[i]));
+			classes.append(cls);
+		}
+		result.set("size_classes", classes);
+	}
+	return result;
+}
+
+// Set the incremental GC pause and step multiplier (in percent, Lua defaults
+// are 200 and 200). Negative values leave a setting unchanged. Returns the
+// previous settings.
+static Variant set_gc_params(int pause, int stepmul) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	const int old_pause = lua_gc(L, LUA_GCSETPAUSE, pause >= 0 ? pause : 0);
+	if (pause < 0)
+		lua_gc(L, LUA_GCSETPAUSE, old_pause);
+	const int old_stepmul = lua_gc(L, LUA_GCSETSTEPMUL, stepmul >= 0 ? stepmul : 0);
+	if (stepmul < 0)
+		lua_gc(L, LUA_GCSETSTEPMUL, old_stepmul);
+
+	Dictionary result = Dictionary::Create();
+	result.set("pause", old_pause);
+	result.set("stepmul", old_stepmul);
+	return result;
+}
+
+// Run an incremental GC step of roughly the given size in KiB (0 = one basic
+// step). Returns true if the step finished a GC cycle.
+static Variant gc_step(int kb) {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	return lua_gc(L, LUA_GCSTEP, kb > 0 ? kb : 0) != 0;
+}
+
+static int lua_panic(lua_State *L) {
+	log_channel.printf("Lua panic: %s\n", lua_tostring(L, -1));
+	// Lua aborts after the panic function returns
+	log_channel.flush();
+	return 0;
+}
+
+// Standard libraries to open, by name. The base library is always opened.
+// An empty selection opens all of them.
+static const luaL_Reg LUA_LIBRARIES[] = {
+	{ LUA_LOADLIBNAME, luaopen_package },
+	{ LUA_TABLIBNAME, luaopen_table },
+	{ LUA_IOLIBNAME, luaopen_io },
+	{ LUA_OSLIBNAME, luaopen_os },
+	{ LUA_STRLIBNAME, luaopen_string },
+	{ LUA_MATHLIBNAME, luaopen_math },
+	{ LUA_DBLIBNAME, luaopen_debug },
+	{ LUA_BITLIBNAME, luaopen_bit },
+	{ LUA_JITLIBNAME, luaopen_jit },
+	{ LUA_FFILIBNAME, luaopen_ffi },
+};
+static std::string selected_libraries;
+
+// Modules compiled into the program, see modules/ and CMakeLists.txt
+struct EmbeddedModule {
+	const char *name;
+	const unsigned char *data;
+	size_t size;
+};
+static const EmbeddedModule embedded_modules[] = {
+	LUA_EMBEDDED_MODULES
+	{ nullptr, nullptr, 0 }
+};
+
+static int load_embedded_module(lua_State *L) {
+	const EmbeddedModule *module = (const EmbeddedModule *)lua_touserdata(L, lua_upvalueindex(1));
+	const std::string chunkname = std::string("=") + module->name;
+	if (luaL_loadbuffer(L, (const char *)module->data, module->size, chunkname.c_str()) != 0)
+		return lua_error(L);
+	lua_pushvalue(L, 1); // The module name, as require() passes it
+	lua_call(L, 1, 1);
+	return 1;
+}
+
+static bool library_selected(const char *name) {
+	if (selected_libraries.empty())
+		return true;
+	// Match whole names in the comma-separated list
+	const std::string_view list = selected_libraries;
+	const size_t len = strlen(name);
+	for (size_t pos = list.find(name); pos != std::string_view::npos; pos = list.find(name, pos + 1)) {
+		const bool starts = pos == 0 || list[pos - 1] == ',';
+		const bool ends = pos + len == list.size() || list[pos + len] == ',';
+		if (starts && ends)
+			return true;
+	}
+	return false;
+}
+
+// Move a library, and submodules such as "jit.util", out of sight of require()
+static void hide_library(const char *name) {
+	lua_getfield(L, LUA_REGISTRYINDEX, HIDDEN_MODULES);
+	const int hidden = lua_gettop(L);
+	const size_t len = strlen(name);
+	for (const char *table : { "_LOADED", "_PRELOAD" }) {
+		lua_getfield(L, LUA_REGISTRYINDEX, table);
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			continue;
+		}
+		const int modules = lua_gettop(L);
+		std::vector<std::string> names;
+		lua_pushnil(L);
+		while (lua_next(L, modules) != 0) {
+			lua_pop(L, 1);
+			if (lua_type(L, -1) != LUA_TSTRING)
+				continue;
+			const char *key = lua_tostring(L, -1);
+			if (strncmp(key, name, len) == 0 && (key[len] == '\0' || key[len] == '.'))
+				names.emplace_back(key);
+		}
+		for (const std::string &key : names) {
+			lua_getfield(L, modules, key.c_str());
+			lua_setfield(L, hidden, key.c_str());
+			lua_pushnil(L);
+			lua_setfield(L, modules, key.c_str());
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	lua_setglobal(L, name);
+}
+
+static void open_libraries() {
+	lua_pushcfunction(L, luaopen_base);
+	lua_pushstring(L, "");
+	lua_call(L, 1, 0);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, HIDDEN_MODULES);
+	for (const luaL_Reg &lib : LUA_LIBRARIES) {
+		// luaopen_jit is what turns the JIT compiler on, so it always runs.
+		// Without "jit" in the selection, it is hidden from scripts.
+		const bool selected = library_selected(lib.name);
+		if (!selected && lib.func != luaopen_jit)
+			continue;
+		lua_pushcfunction(L, lib.func);
+		lua_pushstring(L, lib.name);
+		lua_call(L, 1, 0);
+		if (!selected)
+			hide_library(lib.name);
+	}
+
+	// Embedded modules and the godot module are loaded on require()
+	godot_module_register(L);
+	lua_getglobal(L, LUA_LOADLIBNAME);
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "preload");
+		for (const EmbeddedModule &module : embedded_modules) {
+			if (module.name == nullptr)
+				break;
+			lua_pushlightuserdata(L, (void *)&module);
+			lua_pushcclosure(L, load_embedded_module, 1);
+			lua_setfield(L, -2, module.name);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+// Select the standard libraries to open, as a comma-separated list of names
+// (package, table, io, os, string, math, debug, bit, jit, ffi). Must be called
+// before the Lua state is first used. Embedded modules need "package". The JIT
+// compiler is enabled either way, "jit" only decides if scripts can see it
+// (as a global or through require()).
+static Variant set_libraries(String libraries) {
+	LogFlushGuard flush_guard;
+	if (L != nullptr) {
+		log_channel.printf("set_libraries: the Lua state already exists\n");
+		return false;
+	}
+	selected_libraries = libraries.utf8();
+	return true;
+}
+
+static void init_state() {
+	// The pool allocator needs a GC64 build of LuaJIT, which allows custom
+	// allocators on 64-bit targets. Otherwise use the built-in allocator.
+	L = lua_newstate(lua_pool_alloc, nullptr);
+	if (L != nullptr) {
+		pool_allocator = true;
+		lua_atpanic(L, lua_panic);
+	} else {
+		L = luaL_newstate();
+	}
+
+	open_libraries();
+
+	// API bindings
+	lua_register(L, "print", api_print);
+	lua_register(L, "wait", api_wait);
+	lua_register(L, "yield", api_yield);
+	lua_register(L, "flush", api_flush);
+	events_register(L);
+	luaL_newmetatable(L, STATE_METATABLE);
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+	luaL_newmetatable(L, CALLBACK_METATABLE);
+	lua_pushcfunction(L, callback_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+}
+
+// Tests, run in the shared state. Each returns true on success.
+static bool task_alive(int64_t id) {
+	for (const Task &task : tasks) {
+		if (task.id == id)
+			return true;
+	}
+	return false;
+}
+
+static bool global_is_true(const char *name) {
+	lua_getglobal(L, name);
+	const bool value = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
+// Tick until the task is gone, returning the number of ticks (or -1 if it never finishes)
+static int tick_until_done(int64_t id, int budget) {
+	for (int ticks = 1; ticks <= 10000; ticks++) {
+		tick(budget);
+		if (!task_alive(id))
+			return ticks;
+	}
+	kill(id);
+	return -1;
+}
+
+static bool test_scheduler_budget() {
+	// A long task is interrupted by the budget, and resumed where it left off
+	run("test_done = nil");
+	const int64_t id = spawn("local x = 0 for i = 1, 100000 do x = x + i end test_done = x == 5000050000", 0);
+	tick(10000);
+	if (!budget_exhausted || !task_alive(id) || global_is_true("test_done"))
+		return false;
+	const int ticks = tick_until_done(id, 10000);
+	return ticks > 1 && global_is_true("test_done");
+}
+
+static bool test_scheduler_unyieldable() {
+	// The budget runs out inside a comparator called from C, where yielding is
+	// an error. The task must keep running and yield once it is back in Lua.
+	run("test_sorted = nil");
+	const int64_t id = spawn(R"(
+		local t = {}
+		for i = 1, 64 do t[i] = 65 - i end
+		table.sort(t, function(a, b)
+			local x = 0
+			for j = 1, 200 do x = x + j end
+			return a < b
+		end)
+		test_sorted = t[1] == 1 and t[64] == 64
+		local x = 0
+		for i = 1, 100000 do x = x + i end
+	)", 0);
+	tick(1000);
+	if (!task_alive(id) || !budget_exhausted || !global_is_true("test_sorted"))
+		return false;
+	return tick_until_done(id, 1000000) > 0;
+}
+
+static bool test_scheduler_wait() {
+	// wait(n) skips the task for n ticks, and a yielding task keeps its place
+	run("test_steps = 0");
+	const int64_t id = spawn("test_steps = 1 wait(2) test_steps = 2 yield() test_steps = 3", 0);
+	int64_t steps[4];
+	for (int i = 0; i < 4; i++) {
+		tick(1000000);
+		lua_getglobal(L, "test_steps");
+		steps[i] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	kill(id);
+	return steps[0] == 1 && steps[1] == 1 && steps[2] == 1 && steps[3] == 2 && !budget_exhausted;
+}
+
+static bool test_state_isolation() {
+	const int64_t a = create_state();
+	run_in(a, "x = 1 _G.y = 2");
+	const bool own_globals = bool(run_in(a, "return _G == getfenv(1) and y == 2"));
+	lua_getglobal(L, "y");
+	const bool leaked = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+
+	// Destroying the state stops its tasks, and a new state starts out empty
+	const int64_t task = spawn("while true do wait(1) end", a);
+	destroy_state(a);
+	const bool task_stopped = !task_alive(task);
+	const int64_t b = create_state();
+	const bool fresh = run_in(b, "return x").get_type() == Variant::Type::NIL;
+	destroy_state(b);
+	return own_globals && !leaked && task_stopped && fresh;
+}
+
+static Variant run_tests() {
+	LogFlushGuard flush_guard;
+	ensure_state();
+	bool all_tests_passed = true;
+	if (!test_scheduler_budget()) {
+		log_channel.printf("test_scheduler_budget failed\n");
+		all_tests_passed = false;
+	}
+	if (!test_scheduler_unyieldable()) {
+		log_channel.printf("test_scheduler_unyieldable failed\n");
+		all_tests_passed = false;
+	}
+	if (!test_scheduler_wait()) {
+		log_channel.printf("test_scheduler_wait failed\n");
+		all_tests_passed = false;
+	}
+	if (!test_state_isolation()) {
+		log_channel.printf("test_state_isolation failed\n");
+		all_tests_passed = false;
+	}
+	if (all_tests_passed) {
+		log_channel.printf("All tests passed!\n");
+		return 0;
+	}
+	log_channel.printf("Some tests failed.\n");
+	return 1;
 }
 
 int main() {
@@ -158,15 +1694,60 @@ int main() {
 	});
 #endif
 
-	L = luaL_newstate();
-
-	luaL_openlibs(L); /* Load Lua libraries */
-
-	// API bindings
-	lua_register(L, "print", api_print);
-
+	ADD_API_FUNCTION(set_libraries, "bool", "String libraries",
+		"Select the standard libraries to open, eg. \"package,table,string,math,jit\" (before first use)");
 	ADD_API_FUNCTION(run, "Variant", "String code");
 	ADD_API_FUNCTION(add_function, "void", "String function_name, Callable function");
+	ADD_API_FUNCTION(call_batch, "PackedFloat32Array", "String function_name, PackedFloat32Array args, int stride",
+		"Call a Lua function once per tuple of stride arguments, returning one result per call");
+	ADD_API_FUNCTION(memory_stats, "Dictionary", "", "Current and peak Lua heap usage, and per-size-class block counts");
+	ADD_API_FUNCTION(alloc_tracking_start, "bool", "", "Start recording Lua allocations per call site");
+	ADD_API_FUNCTION(alloc_tracking_stop, "Dictionary", "", "Stop recording, returns allocation counts and bytes per call site");
+	ADD_API_FUNCTION(heap_snapshot, "Dictionary", "", "Count and estimated size of reachable Lua objects by type");
+	ADD_API_FUNCTION(set_gc_params, "Dictionary", "int pause, int stepmul",
+		"Set the GC pause and step multiplier (negative = unchanged), returns the previous values");
+	ADD_API_FUNCTION(gc_step, "bool", "int kb", "Run an incremental GC step, returns true if a cycle finished");
+	ADD_API_FUNCTION(set_pack_numeric_tables, "void", "bool enable",
+		"Convert numeric Lua sequences to PackedInt32Array/PackedFloat32Array instead of Array (on by default)");
+	ADD_API_FUNCTION(add_typed_function, "bool", "String function_name, Callable function, String signature",
+		"Add a function with declared argument types, eg. \"fs:f\" (b=bool, i=int, f=float, s=String, v=any)");
+	ADD_API_FUNCTION(bind_object, "bool", "String name, Object object", "Expose a Godot object to Lua as a global");
+	ADD_API_FUNCTION(connect_event, "int", "Object object, String signal, String event_name",
+		"Queue the signal's emissions as events for the Lua handler set with on_event(event_name, fn)");
+	ADD_API_FUNCTION(dispatch_events, "int", "", "Deliver all queued events to their Lua handlers");
+	ADD_API_FUNCTION(event_stats, "Dictionary", "", "Event queue counters");
+	ADD_API_FUNCTION(bind_view, "bool", "String name, Variant packed",
+		"Expose a packed array to Lua as a global { data = <FFI pointer>, length = n, type = ... }");
+	ADD_API_FUNCTION(commit_view, "Variant", "String name", "Return a packed array with the current contents of a view");
+	ADD_API_FUNCTION(release_view, "bool", "String name", "Free a view and clear its Lua global");
+	ADD_API_FUNCTION(benchmark_callback, "Dictionary", "String function_name, int iterations",
+		"Measure the per-call overhead of a registered function, in nanoseconds");
+	ADD_API_FUNCTION(create_state, "int", "", "Create an isolated script state, returns its id");
+	ADD_API_FUNCTION(destroy_state, "bool", "int state", "Destroy a script state, stopping its tasks and event handlers");
+	ADD_API_FUNCTION(run_in, "Variant", "int state, String code", "Run Lua code in an isolated script state");
+	ADD_API_FUNCTION(state_stats, "Dictionary", "", "Number of live script states");
+	ADD_API_FUNCTION(spawn, "int", "String code, int state",
+		"Run Lua code as a scheduled task in the globals (state 0) or an isolated state, returns the task id");
+	ADD_API_FUNCTION(kill, "bool", "int task", "Stop a scheduled task");
+	ADD_API_FUNCTION(tick, "Dictionary", "int budget", "Resume scheduled tasks within an instruction budget");
+	ADD_API_FUNCTION(profile_start, "bool", "int interval, String mode",
+		"Start sampling: mode \"\" samples every interval instructions, \"jit\" uses jit.profile every interval ms");
+	ADD_API_FUNCTION(profile_stop, "Dictionary", "", "Stop sampling and return hot spots and per-line, function and stack counts");
+	ADD_API_FUNCTION(jit_trace_start, "bool", "int max_events", "Start recording JIT trace events, keeping the last max_events");
+	ADD_API_FUNCTION(jit_trace_stop, "bool", "", "Stop recording JIT trace events");
+	ADD_API_FUNCTION(jit_trace_report, "Dictionary", "",
+		"Trace event counts, the last events, and trace aborts by location and by reason");
+	ADD_API_FUNCTION(set_jit_options, "bool", "Dictionary options",
+		"Set JIT options, eg. { \"hotloop\": 56, \"maxtrace\": 1000, \"maxmcode\": 512, \"enabled\": true }");
+	ADD_API_FUNCTION(configure_mcode, "bool", "int size_kb",
+		"Use a single preallocated machine code area of size_kb for JIT traces");
+	ADD_API_FUNCTION(mcode_stats, "Dictionary", "", "Machine code usage, live and compiled traces, and flush and remap counts");
+	ADD_API_FUNCTION(flush_output, "void", "", "Write buffered print() output now");
+	ADD_API_FUNCTION(set_output_options, "void", "int threshold, bool to_godot",
+		"Flush print() output at threshold bytes (0 writes through), and optionally send it to Godot's print");
+	ADD_API_FUNCTION(cache_stats, "Dictionary", "", "Chunk cache hits, misses, evictions and size");
+	ADD_API_FUNCTION(set_cache_capacity, "void", "int capacity", "Set the maximum number of cached chunks (0 disables the cache)");
+	ADD_API_FUNCTION(run_tests, "int", "", "Runs all tests");
 
 	halt();
 }
@@ -0,0 +1,29 @@
+-- Helpers for scheduled tasks, see spawn() and tick().
+-- Usage: local task = require("task")
+local task = {}
+
+-- Suspend the current task until cond() returns true, checking once per tick
+function task.wait_until(cond)
+	while not cond() do
+		yield()
+	end
+end
+
+-- Call fn once every `ticks` ticks, until it returns false
+function task.every(ticks, fn)
+	while fn() ~= false do
+		wait(ticks - 1)
+	end
+end
+
+-- Run fn(i) for i = 1..n, spreading the calls over ticks in batches of `batch`
+function task.for_batched(n, batch, fn)
+	for i = 1, n do
+		fn(i)
+		if i % batch == 0 then
+			yield()
+		end
+	end
+end
+
+return task
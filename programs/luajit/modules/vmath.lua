@@ -0,0 +1,216 @@
+-- Vector2, Vector3, Quaternion and Transform3D as FFI structs with metatables.
+-- In compiled code LuaJIT sinks the temporary values of expressions such as
+-- a + b * t, so vector math creates no garbage. Vector2 and Vector3 convert to
+-- and from Godot Vector2/Vector3 in functions added with add_function().
+-- Usage: local vmath = require("vmath"); local v = vmath.Vector3(1, 2, 3)
+local ffi = require("ffi")
+local sqrt, sin, cos, acos, atan2 = math.sqrt, math.sin, math.cos, math.acos, math.atan2
+local format, istype = string.format, ffi.istype
+
+ffi.cdef[[
+typedef struct { double x, y; } godot_Vector2;
+typedef struct { double x, y, z; } godot_Vector3;
+typedef struct { double x, y, z, w; } godot_Quaternion;
+typedef struct { godot_Vector3 x, y, z, origin; } godot_Transform3D;
+]]
+
+local Vector2, Vector3, Quaternion, Transform3D
+
+-- Vector2
+
+local vec2 = {}
+vec2.__index = vec2
+
+function vec2.__add(a, b) return Vector2(a.x + b.x, a.y + b.y) end
+function vec2.__sub(a, b) return Vector2(a.x - b.x, a.y - b.y) end
+function vec2.__unm(a) return Vector2(-a.x, -a.y) end
+function vec2.__mul(a, b)
+	if type(a) == "number" then return Vector2(a * b.x, a * b.y) end
+	if type(b) == "number" then return Vector2(a.x * b, a.y * b) end
+	return Vector2(a.x * b.x, a.y * b.y)
+end
+function vec2.__div(a, b)
+	if type(b) == "number" then return Vector2(a.x / b, a.y / b) end
+	return Vector2(a.x / b.x, a.y / b.y)
+end
+function vec2.__eq(a, b)
+	return istype(Vector2, a) and istype(Vector2, b) and a.x == b.x and a.y == b.y
+end
+function vec2.__tostring(a) return format("(%g, %g)", a.x, a.y) end
+
+function vec2.dot(a, b) return a.x * b.x + a.y * b.y end
+function vec2.cross(a, b) return a.x * b.y - a.y * b.x end
+function vec2.length_squared(a) return a.x * a.x + a.y * a.y end
+function vec2.length(a) return sqrt(a.x * a.x + a.y * a.y) end
+function vec2.distance_to(a, b) return (b - a):length() end
+function vec2.angle(a) return atan2(a.y, a.x) end
+function vec2.lerp(a, b, t) return Vector2(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t) end
+function vec2.normalized(a)
+	local len = a:length()
+	if len == 0 then return Vector2(0, 0) end
+	return Vector2(a.x / len, a.y / len)
+end
+
+Vector2 = ffi.metatype("godot_Vector2", vec2)
+
+-- Vector3
+
+local vec3 = {}
+vec3.__index = vec3
+
+function vec3.__add(a, b) return Vector3(a.x + b.x, a.y + b.y, a.z + b.z) end
+function vec3.__sub(a, b) return Vector3(a.x - b.x, a.y - b.y, a.z - b.z) end
+function vec3.__unm(a) return Vector3(-a.x, -a.y, -a.z) end
+function vec3.__mul(a, b)
+	if type(a) == "number" then return Vector3(a * b.x, a * b.y, a * b.z) end
+	if type(b) == "number" then return Vector3(a.x * b, a.y * b, a.z * b) end
+	return Vector3(a.x * b.x, a.y * b.y, a.z * b.z)
+end
+function vec3.__div(a, b)
+	if type(b) == "number" then return Vector3(a.x / b, a.y / b, a.z / b) end
+	return Vector3(a.x / b.x, a.y / b.y, a.z / b.z)
+end
+function vec3.__eq(a, b)
+	return istype(Vector3, a) and istype(Vector3, b) and a.x == b.x and a.y == b.y and a.z == b.z
+end
+function vec3.__tostring(a) return format("(%g, %g, %g)", a.x, a.y, a.z) end
+
+function vec3.dot(a, b) return a.x * b.x + a.y * b.y + a.z * b.z end
+function vec3.cross(a, b)
+	return Vector3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x)
+end
+function vec3.length_squared(a) return a.x * a.x + a.y * a.y + a.z * a.z end
+function vec3.length(a) return sqrt(a.x * a.x + a.y * a.y + a.z * a.z) end
+function vec3.distance_to(a, b) return (b - a):length() end
+function vec3.lerp(a, b, t)
+	return Vector3(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t)
+end
+function vec3.normalized(a)
+	local len = a:length()
+	if len == 0 then return Vector3(0, 0, 0) end
+	return Vector3(a.x / len, a.y / len, a.z / len)
+end
+
+Vector3 = ffi.metatype("godot_Vector3", vec3)
+
+-- Quaternion
+
+local quat = {}
+quat.__index = quat
+
+function quat.__mul(a, b)
+	if istype(Vector3, b) then
+		return a:xform(b)
+	end
+	return Quaternion(
+		a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+		a.w * b.y + a.y * b.w + a.z * b.x - a.x * b.z,
+		a.w * b.z + a.z * b.w + a.x * b.y - a.y * b.x,
+		a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z)
+end
+function quat.__unm(a) return Quaternion(-a.x, -a.y, -a.z, -a.w) end
+function quat.__eq(a, b)
+	return istype(Quaternion, a) and istype(Quaternion, b) and a.x == b.x and a.y == b.y and a.z == b.z and a.w == b.w
+end
+function quat.__tostring(a) return format("(%g, %g, %g, %g)", a.x, a.y, a.z, a.w) end
+
+function quat.dot(a, b) return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w end
+function quat.length(a) return sqrt(a:dot(a)) end
+function quat.normalized(a)
+	local len = a:length()
+	return Quaternion(a.x / len, a.y / len, a.z / len, a.w / len)
+end
+-- The inverse of a unit quaternion
+function quat.inverse(a) return Quaternion(-a.x, -a.y, -a.z, a.w) end
+-- Rotate a vector by a unit quaternion
+function quat.xform(q, v)
+	local tx = 2 * (q.y * v.z - q.z * v.y)
+	local ty = 2 * (q.z * v.x - q.x * v.z)
+	local tz = 2 * (q.x * v.y - q.y * v.x)
+	return Vector3(
+		v.x + q.w * tx + q.y * tz - q.z * ty,
+		v.y + q.w * ty + q.z * tx - q.x * tz,
+		v.z + q.w * tz + q.x * ty - q.y * tx)
+end
+function quat.slerp(a, b, t)
+	local d = a:dot(b)
+	if d < 0 then
+		b, d = -b, -d
+	end
+	local wa, wb
+	if d > 0.9995 then
+		-- Nearly parallel: linear interpolation is accurate and avoids dividing by ~0
+		wa, wb = 1 - t, t
+	else
+		local theta = acos(d)
+		local s = sin(theta)
+		wa, wb = sin((1 - t) * theta) / s, sin(t * theta) / s
+	end
+	return Quaternion(wa * a.x + wb * b.x, wa * a.y + wb * b.y, wa * a.z + wb * b.z, wa * a.w + wb * b.w):normalized()
+end
+
+Quaternion = ffi.metatype("godot_Quaternion", quat)
+
+-- Transform3D: basis axes x, y, z (the columns of the basis) and origin
+
+local xform = {}
+xform.__index = xform
+
+-- Transform a direction, without the origin
+function xform.basis_xform(t, v)
+	return Vector3(
+		t.x.x * v.x + t.y.x * v.y + t.z.x * v.z,
+		t.x.y * v.x + t.y.y * v.y + t.z.y * v.z,
+		t.x.z * v.x + t.y.z * v.y + t.z.z * v.z)
+end
+function xform.xform(t, v)
+	return t:basis_xform(v) + t.origin
+end
+function xform.__mul(a, b)
+	if istype(Vector3, b) then
+		return a:xform(b)
+	end
+	return Transform3D(a:basis_xform(b.x), a:basis_xform(b.y), a:basis_xform(b.z), a:xform(b.origin))
+end
+function xform.inverse(t)
+	local X, Y, Z = t.x, t.y, t.z
+	local r0, r1, r2 = Y:cross(Z), Z:cross(X), X:cross(Y)
+	local inv_det = 1 / X:dot(r0)
+	r0, r1, r2 = r0 * inv_det, r1 * inv_det, r2 * inv_det
+	local o = t.origin
+	return Transform3D(
+		Vector3(r0.x, r1.x, r2.x),
+		Vector3(r0.y, r1.y, r2.y),
+		Vector3(r0.z, r1.z, r2.z),
+		Vector3(-r0:dot(o), -r1:dot(o), -r2:dot(o)))
+end
+function xform.__tostring(t)
+	return format("[X: %s, Y: %s, Z: %s, O: %s]", tostring(t.x), tostring(t.y), tostring(t.z), tostring(t.origin))
+end
+
+Transform3D = ffi.metatype("godot_Transform3D", xform)
+
+local vmath = {
+	Vector2 = Vector2,
+	Vector3 = Vector3,
+	Quaternion = Quaternion,
+	Transform3D = Transform3D,
+}
+
+function vmath.identity()
+	return Transform3D(Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1), Vector3(0, 0, 0))
+end
+
+function vmath.from_axis_angle(axis, angle)
+	local s = sin(angle * 0.5)
+	local n = axis:normalized()
+	return Quaternion(n.x * s, n.y * s, n.z * s, cos(angle * 0.5))
+end
+
+-- The transform of a rotation followed by a translation
+function vmath.from_quaternion(q, origin)
+	return Transform3D(q:xform(Vector3(1, 0, 0)), q:xform(Vector3(0, 1, 0)), q:xform(Vector3(0, 0, 1)),
+		origin or Vector3(0, 0, 0))
+end
+
+return vmath
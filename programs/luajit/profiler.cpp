@@ -0,0 +1,130 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+extern "C" {
+#include <lua.h>
+}
+
+namespace {
+
+constexpr int MAX_STACK_DEPTH = 16;
+
+std::unordered_map<std::string, uint64_t> line_samples;
+std::unordered_map<std::string, uint64_t> function_samples;
+std::unordered_map<std::string, uint64_t> stack_samples;
+uint64_t total_samples = 0;
+
+std::unordered_map<std::string, uint64_t> &samples_for(int which) {
+	switch (which) {
+		case 0:
+			return line_samples;
+		case 1:
+			return function_samples;
+		default:
+			return stack_samples;
+	}
+}
+
+void append_location(std::string &out, const lua_Debug &ar, int line) {
+	out += ar.short_src;
+	out += ':';
+	out += std::to_string(line);
+}
+
+Dictionary to_dictionary(const std::unordered_map<std::string, uint64_t> &samples) {
+	Dictionary dict = Dictionary::Create();
+	for (const auto &[key, count] : samples) {
+		dict.set(String(key), int64_t(count));
+	}
+	return dict;
+}
+
+} // namespace
+
+void profiler_reset() {
+	line_samples.clear();
+	function_samples.clear();
+	stack_samples.clear();
+	total_samples = 0;
+}
+
+void profiler_sample_hook(lua_State *L, lua_Debug *ar) {
+	if (lua_getinfo(L, "Sl", ar) == 0)
+		return;
+	total_samples++;
+
+	std::string key;
+	append_location(key, *ar, ar->currentline);
+	line_samples[key]++;
+	key.clear();
+	append_location(key, *ar, ar->linedefined);
+	function_samples[key]++;
+
+	// Walk the stack from the running function outwards, then store it root first
+	lua_Debug frames[MAX_STACK_DEPTH];
+	int depth = 0;
+	while (depth < MAX_STACK_DEPTH && lua_getstack(L, depth, &frames[depth]) != 0) {
+		lua_getinfo(L, "Sl", &frames[depth]);
+		depth++;
+	}
+	key.clear();
+	for (int i = depth - 1; i >= 0; i--) {
+		if (frames[i].what[0] == 'C') {
+			key += "[C]";
+		} else {
+			append_location(key, frames[i], frames[i].linedefined);
+		}
+		if (i > 0)
+			key += ';';
+	}
+	stack_samples[key]++;
+}
+
+void profiler_merge_table(lua_State *L, int idx, int which) {
+	std::unordered_map<std::string, uint64_t> &samples = samples_for(which);
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			size_t len;
+			const char *key = lua_tolstring(L, -2, &len);
+			const uint64_t count = uint64_t(lua_tonumber(L, -1));
+			samples[std::string(key, len)] += count;
+			if (which == 0)
+				total_samples += count;
+		}
+		lua_pop(L, 1);
+	}
+}
+
+Variant profiler_results(const char *mode, size_t max_hot) {
+	std::vector<std::pair<uint64_t, const std::string *>> hot;
+	hot.reserve(line_samples.size());
+	for (const auto &[key, count] : line_samples) {
+		hot.emplace_back(count, &key);
+	}
+	const size_t n_hot = std::min(max_hot, hot.size());
+	std::partial_sort(hot.begin(), hot.begin() + n_hot, hot.end(),
+		[](const auto &a, const auto &b) { return a.first > b.first; });
+
+	Array hot_spots = Array::Create();
+	for (size_t i = 0; i < n_hot; i++) {
+		Dictionary spot = Dictionary::Create();
+		spot.set("location", String(*hot[i].second));
+		spot.set("samples", int64_t(hot[i].first));
+		spot.set("fraction", total_samples ? double(hot[i].first) / total_samples : 0.0);
+		hot_spots.append(spot);
+	}
+
+	Dictionary result = Dictionary::Create();
+	result.set("mode", mode);
+	result.set("samples", int64_t(total_samples));
+	result.set("hot", hot_spots);
+	result.set("lines", to_dictionary(line_samples));
+	result.set("functions", to_dictionary(function_samples));
+	result.set("stacks", to_dictionary(stack_samples));
+	return result;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <api.hpp>
+#include <cstdint>
+struct lua_State;
+struct lua_Debug;
+
+// Sample aggregation for the Lua profiler. Samples are counted per source
+// line, per function and per call stack (root first, frames separated by ';').
+
+void profiler_reset();
+
+// Record a sample of the running function, from a count hook
+void profiler_sample_hook(lua_State *L, lua_Debug *ar);
+
+// Merge a table of { [key] = count } produced by the jit.profile sampler.
+// which is 0 for lines, 1 for functions and 2 for stacks.
+void profiler_merge_table(lua_State *L, int idx, int which);
+
+// The aggregated samples, with the hottest lines first
+Variant profiler_results(const char *mode, size_t max_hot);
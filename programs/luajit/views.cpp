@@ -0,0 +1,154 @@
+#include "views.hpp"
+
+#include "log_channel.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+extern "C" {
+#include <lauxlib.h>
+#include <lua.h>
+}
+
+namespace {
+
+struct View {
+	Variant::Type type;
+	std::vector<float> f32;
+	std::vector<int32_t> i32;
+	std::vector<Vector3> vec3;
+	std::vector<uint8_t> bytes;
+};
+std::unordered_map<std::string, View> views;
+
+// Lua function (ptr, length, type) -> view table, created on first use
+int make_view_ref = LUA_NOREF;
+
+const char MAKE_VIEW_SOURCE[] = R"(
+local ffi = require("ffi")
+ffi.cdef[[ typedef struct { float x, y, z; } godot_view_vec3_t; ]]
+local ptr_types = {
+	float = ffi.typeof("float *"),
+	int32 = ffi.typeof("int32_t *"),
+	vec3 = ffi.typeof("godot_view_vec3_t *"),
+	byte = ffi.typeof("uint8_t *"),
+}
+return function(ptr, length, type)
+	return { data = ffi.cast(ptr_types[type], ptr), length = length, type = type }
+end
+)";
+
+bool push_make_view(lua_State *L) {
+	if (make_view_ref == LUA_NOREF) {
+		if (luaL_loadbuffer(L, MAKE_VIEW_SOURCE, sizeof(MAKE_VIEW_SOURCE) - 1, "=views") != 0 || lua_pcall(L, 0, 1, 0) != 0) {
+			log_channel.printf("Failed to initialize packed array views: %s\n", lua_tostring(L, -1));
+			lua_pop(L, 1);
+			return false;
+		}
+		make_view_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, make_view_ref);
+	return true;
+}
+
+} // namespace
+
+bool view_bind(lua_State *L, const std::string &name, const Variant &packed) {
+	View view;
+	view.type = packed.get_type();
+	void *data;
+	size_t length;
+	const char *type;
+	switch (view.type) {
+		case Variant::PACKED_FLOAT32_ARRAY: {
+			PackedArray<float> array = packed;
+			view.f32 = array.fetch();
+			type = "float";
+			break;
+		}
+		case Variant::PACKED_INT32_ARRAY: {
+			PackedArray<int32_t> array = packed;
+			view.i32 = array.fetch();
+			type = "int32";
+			break;
+		}
+		case Variant::PACKED_VECTOR3_ARRAY: {
+			PackedArray<Vector3> array = packed;
+			view.vec3 = array.fetch();
+			type = "vec3";
+			break;
+		}
+		case Variant::PACKED_BYTE_ARRAY: {
+			PackedArray<uint8_t> array = packed;
+			view.bytes = array.fetch();
+			type = "byte";
+			break;
+		}
+		default:
+			log_channel.printf("bind_view: unsupported type %d for %s\n", int(view.type), name.c_str());
+			return false;
+	}
+	if (!push_make_view(L))
+		return false;
+
+	switch (view.type) {
+		case Variant::PACKED_FLOAT32_ARRAY:
+			data = view.f32.data();
+			length = view.f32.size();
+			break;
+		case Variant::PACKED_INT32_ARRAY:
+			data = view.i32.data();
+			length = view.i32.size();
+			break;
+		case Variant::PACKED_VECTOR3_ARRAY:
+			data = view.vec3.data();
+			length = view.vec3.size();
+			break;
+		default:
+			data = view.bytes.data();
+			length = view.bytes.size();
+			break;
+	}
+
+	lua_pushlightuserdata(L, data);
+	lua_pushnumber(L, lua_Number(length));
+	lua_pushstring(L, type);
+	if (lua_pcall(L, 3, 1, 0) != 0) {
+		log_channel.printf("bind_view: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		// Do not leave a previous view of the same name half replaced
+		view_release(L, name);
+		return false;
+	}
+	// A previous view of the same name is only freed now. Moving the vectors
+	// into the map keeps their buffers where they are.
+	views[name] = std::move(view);
+	lua_setglobal(L, name.c_str());
+	return true;
+}
+
+Variant view_commit(const std::string &name) {
+	auto it = views.find(name);
+	if (it == views.end())
+		return Nil;
+	const View &view = it->second;
+	switch (view.type) {
+		case Variant::PACKED_FLOAT32_ARRAY:
+			return PackedArray<float>(view.f32);
+		case Variant::PACKED_INT32_ARRAY:
+			return PackedArray<int32_t>(view.i32);
+		case Variant::PACKED_VECTOR3_ARRAY:
+			return PackedArray<Vector3>(view.vec3);
+		default:
+			return PackedArray<uint8_t>(view.bytes);
+	}
+}
+
+bool view_release(lua_State *L, const std::string &name) {
+	if (views.erase(name) == 0)
+		return false;
+	lua_pushnil(L);
+	lua_setglobal(L, name.c_str());
+	return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <api.hpp>
+#include <string>
+struct lua_State;
+
+// Packed array views: the contents of a packed array are fetched once into a
+// buffer owned by the program, and exposed to Lua as a global table
+// { data = <FFI pointer>, length = n, type = "..." }. Lua code reads and writes
+// the buffer directly through the pointer (0-based), so numeric loops are
+// trace compiled without going through the Lua stack.
+//
+// Supported: PackedFloat32Array (float*), PackedInt32Array (int32_t*),
+// PackedVector3Array (struct with float x, y, z) and PackedByteArray (uint8_t*).
+
+// Bind a view of the packed array to a Lua global. Returns false if the type is not supported.
+bool view_bind(lua_State *L, const std::string &name, const Variant &packed);
+
+// Return a new packed array with the current contents of the view, or Nil if there is no such view
+Variant view_commit(const std::string &name);
+
+// Free the buffer and clear the Lua global. Any pointers Lua still holds become dangling.
+bool view_release(lua_State *L, const std::string &name);
@@ -1,4 +1,5 @@
 #include <api.hpp>
+#include "log_channel.hpp"
 #include <cstring>
 extern "C" {
 #include <mir-gen.h>
@@ -28,9 +29,43 @@ static int get_cfunc(void *opaque) {
 static MIR_context_t ctx;
 static const int optlevel = 2;
 
+// Debugging API, buffered in the log channel
+static void print_int(int i) {
+	log_channel.printf("Int: %d", i);
+}
+static void print_float(float f) {
+	log_channel.printf("Float: %f", f);
+}
+static void print_string(const char *s) {
+	log_channel.printf("String: %s", s);
+}
+static void print_ptr(void *p) {
+	log_channel.printf("Pointer: %p", p);
+}
+static void flush_output_c() {
+	log_channel.flush();
+}
+
+// Compiled functions are called through a trampoline, with their address
+// bound as the argument, so that their output is flushed when they return
+static Variant compiled_trampoline(Variant address) {
+	LogFlushGuard flush_guard;
+	return ((Variant(*)())uintptr_t(int64_t(address)))();
+}
+
 static void *import_resolver(const char *name) {
 	if (strcmp(name, "sys_print") == 0) {
 		return (void *)sys_print;
+	} else if (strcmp(name, "print_int") == 0) {
+		return (void *)print_int;
+	} else if (strcmp(name, "print_float") == 0) {
+		return (void *)print_float;
+	} else if (strcmp(name, "print_string") == 0) {
+		return (void *)print_string;
+	} else if (strcmp(name, "print_ptr") == 0) {
+		return (void *)print_ptr;
+	} else if (strcmp(name, "flush_output") == 0) {
+		return (void *)flush_output_c;
 	} else if (strcmp(name, "sys_vfetch") == 0) {
 		return (void *)sys_vfetch;
 	} else if (strcmp(name, "sys_vstore") == 0) {
@@ -40,8 +75,7 @@ static void *import_resolver(const char *name) {
 	} else if (strcmp(name, "free") == 0) {
 		return (void *)free;
 	}
-	printf("import_resolver missing: %s\n", name);
-	fflush(stdout);
+	log_channel.printf("import_resolver missing: %s\n", name);
 	return nullptr;
 }
 
@@ -59,14 +93,15 @@ static MIR_item_t mir_find_function(MIR_module_t module, const char *func_name)
 static void *mir_get_func(MIR_context_t ctx, MIR_module_t module, const char *func_name) {
 	MIR_item_t func_item = mir_find_function(module, func_name);
 	if (func_item == NULL) {
-		fprintf(stderr, "Error: Mir function %s not found\n", func_name);
-		fflush(stdout);
+		log_channel.printf("Error: Mir function %s not found\n", func_name);
 		return NULL;
 	}
 	return MIR_gen(ctx, func_item);
 }
 
 static __attribute__((noreturn)) void error_func(MIR_error_type_t error_type, const char *format, ...) {
+	// Write what was buffered before, as this aborts
+	log_channel.flush();
 	va_list args;
 	va_start(args, format);
 	vprintf(format, args);
@@ -85,8 +120,7 @@ static Variant do_compile(const std::string &source_code, const std::string &ent
 	};
 
 #if VERBOSE_COMPILE
-	printf("Compiling C code: %s\n", source_code.c_str());
-	fflush(stdout);
+	log_channel.printf("Compiling C code: %s\n", source_code.c_str());
 #endif
 
 	// Add our own API
@@ -97,6 +131,7 @@ static Variant do_compile(const std::string &source_code, const std::string &ent
 	extern void print_float(float);
 	extern void print_string(const char*);
 	extern void print_ptr(void*);
+	extern void flush_output(void);
 	extern void *malloc(unsigned long);
 	extern void free(void*);
 	struct Variant {
@@ -126,21 +161,18 @@ static Variant do_compile(const std::string &source_code, const std::string &ent
 	ops.macro_commands = macro_commands.data();
 	int result = c2mir_compile(ctx, &ops, &get_cfunc, (void*)&data, "test.c", nullptr);
 	if (!result) {
-		printf("Failed to compile C code\n");
-		fflush(stdout);
+		log_channel.printf("Failed to compile C code\n");
 		return Nil;
 	}
 
 #if VERBOSE_COMPILE
-	printf("*** Compilation successful\n");
-	fflush(stdout);
+	log_channel.printf("*** Compilation successful\n");
 #endif
 	c2mir_finish(ctx);
 
 	auto *module = DLIST_TAIL(MIR_module_t, *MIR_get_module_list(ctx));
 	if (!module) {
-		fprintf(stderr, "No module found\n");
-		fflush(stdout);
+		log_channel.printf("No module found\n");
 		return Nil;
 	}
 	MIR_gen_init(ctx);
@@ -157,32 +189,42 @@ static Variant do_compile(const std::string &source_code, const std::string &ent
 	MIR_gen_finish(ctx);
 
 	if (!fun_addr) {
-		fprintf(stderr, "Function %s not found\n", entry.c_str());
-		fflush(stdout);
+		log_channel.printf("Function %s not found\n", entry.c_str());
 		return Nil;
 	}
 #if VERBOSE_COMPILE
-	printf("Function %s found, address %p\n", entry.c_str(), fun_addr);
-	fflush(stdout);
+	log_channel.printf("Function %s found, address %p\n", entry.c_str(), fun_addr);
 #endif
 
-	// Return a callable function
-	return Callable::Create<Variant()>(fun_addr);
+	// Return a callable function, bound to the trampoline
+	Variant callable = Callable::Create<Variant(Variant)>(compiled_trampoline);
+	Variant bound;
+	const Variant address = int64_t(uintptr_t(fun_addr));
+	callable.callp("bind", &address, 1, bound);
+	return bound;
 }
 
 static Variant compile(String code, String entry) {
+	LogFlushGuard flush_guard;
 	const std::string utf = code.utf8();
 	const std::string entry_utf = entry.utf8();
 
 	return do_compile(utf, entry);
 }
 
+// Output from the print_* helpers is buffered, see log_channel.hpp
+static Variant flush_output() {
+	log_channel.flush();
+	return Nil;
+}
+
 int main() {
 	ctx = MIR_init();
 	MIR_set_error_func(ctx, error_func);
 
 	// The public API
 	ADD_API_FUNCTION(compile, "Callable", "String code, String entry");
+	ADD_API_FUNCTION(flush_output, "void", "", "Write buffered output from compiled code");
 
 	halt();
 }
@@ -17,6 +17,9 @@
 #include <igl/slice_mask.h>
 #include <igl/min_quad_with_fixed.h>
 
+#include "nonmanifold_tests.h"
+#include "process_mesh.h"
+
 /**
  * Given a number of points find their closest points on the surface of the V,F mesh
  * 
@@ -793,6 +796,128 @@ static Variant robust_weight_transfer(Mesh source_mesh, Mesh target_mesh, Dictio
 	return true;
 }
 
+// Read the positions and triangles of a mesh surface. A surface without indices is read as a point cloud.
+static bool read_mesh_surface(Mesh mesh, int64_t surface, std::vector<std::array<double, 3>>& positions,
+							  std::vector<std::array<size_t, 3>>& triangles) {
+	Array mesh_arrays = mesh.surface_get_arrays(surface);
+	if (mesh_arrays.size() <= Mesh::ARRAY_VERTEX || mesh_arrays.size() <= Mesh::ARRAY_INDEX) {
+		std::cerr << "Mesh arrays are incomplete" << std::endl;
+		return false;
+	}
+
+	PackedArray<Vector3> vertices_ref;
+	if (!mesh_arrays[Mesh::ARRAY_VERTEX].get_as_type(Variant::PACKED_VECTOR3_ARRAY, vertices_ref)) {
+		std::cerr << "vertices_variant is null" << std::endl;
+		return false;
+	}
+	std::vector<Vector3> vertices = vertices_ref.fetch();
+
+	std::vector<int32_t> faces;
+	PackedArray<int32_t> faces_ref;
+	if (mesh_arrays[Mesh::ARRAY_INDEX].get_as_type(Variant::PACKED_INT32_ARRAY, faces_ref)) {
+		faces = faces_ref.fetch();
+	}
+
+	positions.resize(vertices.size());
+	for (size_t i = 0; i < vertices.size(); ++i) {
+		positions[i] = { vertices[i].x, vertices[i].y, vertices[i].z };
+	}
+	if (faces.size() % 3 != 0) {
+		std::cerr << "Face indices are not a list of triangles" << std::endl;
+		return false;
+	}
+	for (int32_t index : faces) {
+		if (index < 0 || size_t(index) >= vertices.size()) {
+			std::cerr << "Face index " << index << " is out of range" << std::endl;
+			return false;
+		}
+	}
+	triangles.resize(faces.size() / 3);
+	for (size_t i = 0; i < triangles.size(); ++i) {
+		triangles[i] = { size_t(faces[i * 3]), size_t(faces[i * 3 + 1]), size_t(faces[i * 3 + 2]) };
+	}
+	return true;
+}
+
+static Dictionary stats_to_dictionary(const TuftedLaplacianStats& stats) {
+	Dictionary result = Dictionary::Create();
+	result.set("load_ms", stats.loadMs);
+	result.set("point_cloud_ms", stats.pointCloudMs);
+	result.set("strip_triangulate_ms", stats.stripTriangulateMs);
+	result.set("halfedge_ms", stats.halfedgeMs);
+	result.set("tufted_ms", stats.tuftedMs);
+	result.set("cover_ms", stats.coverMs);
+	result.set("mollify_ms", stats.mollifyMs);
+	result.set("flip_ms", stats.flipMs);
+	result.set("matrix_ms", stats.matrixMs);
+	result.set("reindex_ms", stats.reindexMs);
+	result.set("output_ms", stats.outputMs);
+	result.set("total_ms", stats.totalMs);
+	result.set("point_cloud", stats.isPointCloud);
+	result.set("input_vertices", int64_t(stats.nInputVertices));
+	result.set("input_faces", int64_t(stats.nInputFaces));
+	result.set("vertices", int64_t(stats.nVertices));
+	result.set("faces", int64_t(stats.nFaces));
+	result.set("flips", int64_t(stats.nFlips));
+	result.set("replayed_flips", int64_t(stats.nReplayedFlips));
+	result.set("rebuilt", stats.rebuilt);
+	result.set("laplacian_nnz", int64_t(stats.laplacianNonzeros));
+	result.set("avg_neighbors", stats.avgNeighbors);
+	return result;
+}
+
+static Variant tufted_laplacian_stats(Mesh mesh, Dictionary arguments) {
+	int64_t surface = arguments.has("surface") ? int64_t(arguments["surface"].value()) : 0;
+	double mollify_factor = arguments.has("mollify_factor") ? double(arguments["mollify_factor"].value()) : 1e-6;
+	int64_t n_neigh = arguments.has("n_neigh") ? int64_t(arguments["n_neigh"].value()) : 30;
+	bool adaptive_neighbors = arguments.has("adaptive_neighbors") ? bool(arguments["adaptive_neighbors"].value()) : false;
+	int64_t n_neigh_min = arguments.has("n_neigh_min") ? int64_t(arguments["n_neigh_min"].value()) : 8;
+
+	std::vector<std::array<double, 3>> positions;
+	std::vector<std::array<size_t, 3>> triangles;
+	if (!read_mesh_surface(mesh, surface, positions, triangles)) {
+		return Nil;
+	}
+
+	TuftedLaplacianStats stats = processMeshArrays(positions, triangles, mollify_factor, n_neigh, adaptive_neighbors, n_neigh_min);
+	return stats_to_dictionary(stats);
+}
+
+// Set up the cached tufted Laplacian for a triangle mesh surface whose connectivity will stay fixed
+static Variant tufted_laplacian_build(Mesh mesh, Dictionary arguments) {
+	int64_t surface = arguments.has("surface") ? int64_t(arguments["surface"].value()) : 0;
+	double mollify_factor = arguments.has("mollify_factor") ? double(arguments["mollify_factor"].value()) : 1e-6;
+
+	std::vector<std::array<double, 3>> positions;
+	std::vector<std::array<size_t, 3>> triangles;
+	if (!read_mesh_surface(mesh, surface, positions, triangles)) {
+		return Nil;
+	}
+
+	TuftedLaplacianStats stats;
+	if (!tuftedLaplacianBuild(positions, triangles, mollify_factor, stats)) {
+		std::cerr << "The cached tufted Laplacian needs triangles which use every vertex" << std::endl;
+		return Nil;
+	}
+	return stats_to_dictionary(stats);
+}
+
+// Recompute the cached tufted Laplacian for new vertex positions of the mesh given to tufted_laplacian_build()
+static Variant tufted_laplacian_update(PackedArray<Vector3> positions_ref) {
+	std::vector<Vector3> vertices = positions_ref.fetch();
+	std::vector<std::array<double, 3>> positions(vertices.size());
+	for (size_t i = 0; i < vertices.size(); ++i) {
+		positions[i] = { vertices[i].x, vertices[i].y, vertices[i].z };
+	}
+
+	TuftedLaplacianStats stats;
+	if (!tuftedLaplacianUpdate(positions, stats)) {
+		std::cerr << "No cached tufted Laplacian with " << positions.size() << " vertices" << std::endl;
+		return Nil;
+	}
+	return stats_to_dictionary(stats);
+}
+
 bool test_robust_weight_transfer() {
 	Eigen::MatrixXd vertices_1(3, 3);
 	vertices_1 << 0, 0, 0,
@@ -888,6 +1013,18 @@ static Variant run_tests() {
 		std::cerr << "test_robust_weight_transfer failed" << std::endl;
 		all_tests_passed = false;
 	}
+	if (!testTuftedLaplacianCache()) {
+		std::cerr << "testTuftedLaplacianCache failed" << std::endl;
+		all_tests_passed = false;
+	}
+	if (!testFastMeshLoader()) {
+		std::cerr << "testFastMeshLoader failed" << std::endl;
+		all_tests_passed = false;
+	}
+	if (!testIncrementalKnn()) {
+		std::cerr << "testIncrementalKnn failed" << std::endl;
+		all_tests_passed = false;
+	}
 	if (all_tests_passed) {
 		std::cout << "All tests passed!" << std::endl;
 		return 0;
@@ -900,6 +1037,9 @@ static Variant run_tests() {
 int main() {
 	// Add a public API
 	ADD_API_FUNCTION(robust_weight_transfer, "bool", "Mesh source_mesh, Mesh target_mesh, Dictionary arguments, Array matched_array, Array interpolated_weights_array, Array inpainted_weights_array, Array smoothed_weights_array", "Robust Weight Transfer");
+	ADD_API_FUNCTION(tufted_laplacian_stats, "Dictionary", "Mesh mesh, Dictionary arguments", "Builds the tufted Laplacian of a mesh surface and returns per-phase timings and counters");
+	ADD_API_FUNCTION(tufted_laplacian_build, "Dictionary", "Mesh mesh, Dictionary arguments", "Caches the tufted Laplacian of a triangle mesh surface whose connectivity stays fixed, returns timings and counters");
+	ADD_API_FUNCTION(tufted_laplacian_update, "Dictionary", "PackedVector3Array positions", "Updates the cached tufted Laplacian for new vertex positions, returns timings and counters");
 	ADD_API_FUNCTION(run_tests, "int", "", "Runs all tests");
 
 	halt();
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// A polygon mesh stored in flat arrays, as produced by the fast loader
+struct FlatMesh {
+  std::vector<double> vertexCoordinates; // x, y, z for each vertex
+  std::vector<size_t> faceIndices;       // the corners of all faces, concatenated
+  std::vector<size_t> faceStarts;        // offset of each face in faceIndices, plus a final entry for the end
+
+  size_t nVertices() const { return vertexCoordinates.size() / 3; }
+  size_t nFaces() const { return faceStarts.empty() ? 0 : faceStarts.size() - 1; }
+};
+
+// True if the file extension is one the fast loader can read (.obj, .ply)
+bool hasFastLoader(const std::string& filename);
+
+// Load an OBJ or PLY (ascii, binary little- or big-endian) file. The file is memory-mapped and parsed in place, without
+// iostreams. Only vertex positions and faces are read. Throws std::runtime_error on failure.
+FlatMesh loadFlatMesh(const std::string& filename);
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "geometrycentral/utilities/vector3.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+using geometrycentral::Vector3;
+
+using Neighbors_t = std::vector<std::vector<size_t>>;
+
+// A spatial hash grid over a point set which grows and shrinks over time (capture sessions, spawned points). Unlike
+// geometrycentral::NearestNeighborFinder it does not need to be rebuilt when points are added or removed.
+//
+// Point ids are stable: they are assigned in insertion order and never reused, so a removed id simply stays dead.
+class IncrementalKnnIndex {
+
+public:
+  static constexpr size_t INVALID_ID = std::numeric_limits<size_t>::max();
+  using CellCoord = std::array<int64_t, 3>;
+
+  // Cells are keyed by their full coordinates, so distinct cells never share a bucket
+  struct CellHash {
+    size_t operator()(const CellCoord& c) const {
+      uint64_t h = static_cast<uint64_t>(c[0]) * 0x9E3779B97F4A7C15ull;
+      h ^= static_cast<uint64_t>(c[1]) * 0xC2B2AE3D27D4EB4Full + (h << 6) + (h >> 2);
+      h ^= static_cast<uint64_t>(c[2]) * 0x165667B19E3779F9ull + (h << 6) + (h >> 2);
+      return static_cast<size_t>(h);
+    }
+  };
+
+  explicit IncrementalKnnIndex(double cellSize);
+
+  // Pick a cell size for points sampled from a surface, so that a cell holds roughly k points, and insert them all
+  IncrementalKnnIndex(const std::vector<Vector3>& points, size_t k);
+
+  // Modification
+  size_t insert(Vector3 position);
+  void remove(size_t id);
+
+  // Accessors
+  bool isAlive(size_t id) const { return id < alive.size() && alive[id]; }
+  size_t nAlive() const { return aliveCount; }
+  size_t nIds() const { return positions.size(); } // including dead ids
+  Vector3 position(size_t id) const { return positions[id]; }
+  double getCellSize() const { return cellSize; }
+  size_t nCells() const { return cells.size(); }
+
+  // Queries. Results are sorted by distance, and never include `exclude`.
+  std::vector<size_t> kNearestNeighbors(Vector3 query, size_t k, size_t exclude = INVALID_ID) const;
+  std::vector<size_t> kNearestNeighbors(size_t id, size_t k) const;
+  Neighbors_t kNearestNeighborsBatch(const std::vector<size_t>& ids, size_t k) const;
+  std::vector<size_t> radiusSearch(Vector3 query, double radius) const;
+
+  // Cells, for searches which prune whole cells. Cells only hold alive points.
+  CellCoord cellOf(Vector3 p) const;
+  const std::vector<size_t>* cellPoints(const CellCoord& c) const;
+  void forEachCell(const std::function<void(const CellCoord&, const std::vector<size_t>&)>& fn) const;
+
+  // Distance from `p` to the closest point of cell `c`
+  double distanceToCell(Vector3 p, const CellCoord& c) const;
+
+private:
+  double cellSize;
+  std::unordered_map<CellCoord, std::vector<size_t>, CellHash> cells;
+  std::vector<Vector3> positions;
+  std::vector<char> alive;
+  size_t aliveCount = 0;
+
+  // Bounds of the occupied cells, used to end ring searches. Recomputed lazily after a boundary cell empties.
+  mutable CellCoord cellMin{0, 0, 0};
+  mutable CellCoord cellMax{-1, -1, -1};
+  mutable bool boundsStale = false;
+
+  void refreshBounds() const;
+};
+
+// Neighborhoods of all alive points of an index, kept up to date as points are inserted and removed.
+//
+// A point's neighborhood can only change because of a changed point which is closer to it than its k-th neighbor.
+// Every cell keeps an upper bound of the k-th neighbor distance of its points, so an update only looks at the cells
+// around each changed point which can hold an affected point, instead of the whole point set.
+//
+// This is a library building block: processMesh() and the sandbox API still build point cloud neighborhoods from
+// scratch with generate_knn(), and nothing consumes the changed ids yet.
+class IncrementalNeighborhoods {
+
+public:
+  IncrementalNeighborhoods(const IncrementalKnnIndex& index, size_t k);
+
+  // Bring neighborhoods up to date after points were inserted into and/or removed from the index. Returns the ids whose
+  // neighborhood changed: the inserted points, plus existing points which gained a new point among their k nearest or
+  // lost a removed one. Normals and local triangulations only need to be recomputed for those.
+  std::vector<size_t> update(const std::vector<size_t>& insertedIds, const std::vector<size_t>& removedIds);
+
+  // Indexed by point id, empty for dead ids
+  const Neighbors_t& neighbors() const { return neigh; }
+
+  // Number of points whose distance was tested in the last update(), for profiling
+  size_t lastPointsTested = 0;
+
+private:
+  const IncrementalKnnIndex& index;
+  size_t k;
+  Neighbors_t neigh;
+  std::vector<double> kthDistance; // infinite if the neighborhood has fewer than k points
+
+  // Upper bound of kthDistance over the points of each cell, and over all points
+  std::unordered_map<IncrementalKnnIndex::CellCoord, double, IncrementalKnnIndex::CellHash> cellKthBound;
+  double globalKthBound = 0.;
+
+  void recompute(size_t id);
+  void collectAffected(Vector3 p, const std::vector<char>& skip, const std::function<void(size_t)>& visit);
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+// Tests for the additions to the nonmanifold Laplacian pipeline. Each returns true on success and describes any
+// failure on std::cerr.
+
+// TuftedLaplacianCache::build() and update() against geometry-central's buildTuftedLaplacian()
+bool testTuftedLaplacianCache();
+
+// loadFlatMesh() against geometry-central's mesh reader, and rejection of malformed PLY files
+bool testFastMeshLoader();
+
+// IncrementalKnnIndex and IncrementalNeighborhoods against brute-force kNN
+bool testIncrementalKnn();
@@ -19,6 +19,13 @@ using Neighbors_t = std::vector<std::vector<size_t>>;
 // The list will _not_ include the center point.
 Neighbors_t generate_knn(const std::vector<Vector3>& points, size_t k);
 
+// Generate adaptive neighborhoods: each point starts from its kMin nearest neighbors, and the neighborhood is grown
+// (up to kMax) only until its local Delaunay fan closes around the point and every circumcircle of the fan fits inside
+// the neighborhood radius, so farther points are unlikely to change the fan. Neighbors are sorted by distance.
+// If `avgDegree` is given, it receives the mean neighborhood size.
+Neighbors_t generate_knn_adaptive(const std::vector<Vector3>& points, size_t kMin, size_t kMax,
+                                  double* avgDegree = nullptr);
+
 // Estimate normals from a neighborhood (arbitrarily oriented)
 std::vector<Vector3> generate_normals(const std::vector<Vector3>& points, const Neighbors_t& neigh);
 
@@ -35,5 +42,14 @@ struct LocalTriangulationResult {
                                                                   // numbered such that the center vertex comes first
 };
 
+struct LocalFanResult {
+  std::vector<std::array<size_t, 3>> triangles; // as in LocalTriangulationResult::pointTriangles
+  bool closed = false;         // true if the triangles wind all the way around the center without gaps
+  double maxCircumradius = 0.; // largest circumradius among the triangles
+};
+
+// Triangulate a single planar-projected neighborhood, see build_delaunay_triangulations()
+LocalFanResult build_delaunay_fan(const std::vector<Vector2>& coords);
+
 LocalTriangulationResult build_delaunay_triangulations(const std::vector<std::vector<Vector2>>& coords,
                                                        const Neighbors_t& neigh);
@@ -0,0 +1,60 @@
+#pragma once
+
+// No geometry-central types here: this header is included next to the Godot API, which has its own Vector3.
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Per-phase timings (in milliseconds) and counters for one run of the tufted Laplacian pipeline
+struct TuftedLaplacianStats {
+  double loadMs = 0.;
+  double pointCloudMs = 0.;       // kNN, normals and local triangulations, point clouds only
+  double stripTriangulateMs = 0.; // strip duplicate/unused vertices, triangulate
+  double halfedgeMs = 0.;         // makeGeneralHalfedgeAndGeometry
+  double tuftedMs = 0.;           // buildTuftedLaplacian, all of the four phases below
+  double coverMs = 0.;            // cover, mollification, flips and matrices: TuftedLaplacianCache only
+  double mollifyMs = 0.;
+  double flipMs = 0.;
+  double matrixMs = 0.;
+  double reindexMs = 0.;
+  double outputMs = 0.;
+  double totalMs = 0.;
+
+  bool isPointCloud = false;
+  size_t nInputVertices = 0;
+  size_t nInputFaces = 0;
+  size_t nVertices = 0;
+  size_t nFaces = 0;
+  size_t nFlips = 0;         // TuftedLaplacianCache only, flips done by the Delaunay flip loop
+  size_t nReplayedFlips = 0; // TuftedLaplacianCache only, recorded flips replayed by an update
+  bool rebuilt = false;      // TuftedLaplacianCache only, the update fell back to a full build
+  size_t laplacianNonzeros = 0;
+  double avgNeighbors = 0.; // mean neighborhood size, point clouds only
+};
+
+// Format the stats as a single line of JSON, prefixed with "tufted_stats " so it is easy to grep from CLI output
+std::string formatStatsLine(const TuftedLaplacianStats& stats);
+
+// With `adaptiveNeigh`, point cloud neighborhoods grow from nNeighMin up to nNeigh points, see generate_knn_adaptive()
+void processMesh(const std::string& inputFilename, float mollifyFactor, unsigned int nNeigh, bool adaptiveNeigh,
+                 unsigned int nNeighMin, double laplacianReplaceVal, double massReplaceVal,
+                 const std::string& outputPrefix, bool gui, bool writeLaplacian, bool writeMass,
+                 TuftedLaplacianStats* stats = nullptr);
+
+// Run the pipeline on in-memory data instead of a file; no output is written. An empty `triangles` list is treated as a
+// point cloud.
+TuftedLaplacianStats processMeshArrays(const std::vector<std::array<double, 3>>& positions,
+                                       const std::vector<std::array<size_t, 3>>& triangles, float mollifyFactor,
+                                       unsigned int nNeigh, bool adaptiveNeigh = false,
+                                       unsigned int nNeighMin = 8);
+
+// Cached tufted Laplacian (see TuftedLaplacianCache) for one triangle mesh whose connectivity stays fixed while its
+// vertices move. tuftedLaplacianBuild() sets up the cache and returns false if the mesh has no triangles or a vertex
+// is not used by any of them. tuftedLaplacianUpdate() recomputes the matrices for new positions, indexed like the ones
+// given to the build, and returns false if there is no cache or the vertex count differs.
+bool tuftedLaplacianBuild(const std::vector<std::array<double, 3>>& positions,
+                          const std::vector<std::array<size_t, 3>>& triangles, float mollifyFactor,
+                          TuftedLaplacianStats& stats);
+bool tuftedLaplacianUpdate(const std::vector<std::array<double, 3>>& positions, TuftedLaplacianStats& stats);
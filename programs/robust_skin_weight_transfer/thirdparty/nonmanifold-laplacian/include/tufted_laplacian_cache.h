@@ -0,0 +1,76 @@
+#pragma once
+
+#include "geometrycentral/surface/surface_mesh.h"
+#include "geometrycentral/surface/vertex_position_geometry.h"
+
+#include <array>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+using namespace geometrycentral;
+using namespace geometrycentral::surface;
+
+// Cached tufted Laplacian for meshes whose connectivity stays fixed while the vertex positions change (animation,
+// sculpting). The first build() does the same work as buildTuftedLaplacian(), in the same order: intrinsic
+// mollification of the input, tufted cover and intrinsic Delaunay flips. The cover and the sequence of flips which led
+// to the Delaunay triangulation are kept.
+//
+// update() then recomputes and mollifies the input edge lengths from the new positions, copies them to the cover,
+// replays the recorded flips (each one is a constant-time layout of a quad, with no Delaunay tests or queue) and only
+// runs the Delaunay flip loop on the few edges which are no longer Delaunay. If a replayed flip becomes invalid for the
+// new geometry, or the recorded flip log has grown too long, the cache falls back to a full rebuild.
+//
+// NOTE: the ordering of faces around nonmanifold edges in the cover is decided from the positions given to build(),
+// and is kept for all later updates.
+class TuftedLaplacianCache {
+
+public:
+  // Parameters
+  double mollifyFactor = 0.;
+  double delaunayEPS = 1e-6;
+  double maxFlipLogGrowth = 2.; // rebuild once the flip log exceeds this multiple of its size after the last build
+
+  // Build everything from scratch. Returns the (weak) Laplacian and the lumped mass matrix.
+  // `mesh` must outlive the cache, it is used again if update() has to fall back to a rebuild.
+  std::tuple<SparseMatrix<double>, SparseMatrix<double>> build(SurfaceMesh& mesh, VertexPositionGeometry& geom);
+
+  // Recompute the matrices for new vertex positions, indexed like the vertices of the mesh given to build().
+  std::tuple<SparseMatrix<double>, SparseMatrix<double>> update(const std::vector<Vector3>& positions);
+
+  bool isBuilt() const { return coverMesh != nullptr; }
+
+  // Counters for the most recent build() or update()
+  bool lastWasRebuild = false;
+  size_t lastReplayedFlips = 0;
+  size_t lastNewFlips = 0;
+  double lastCoverMs = 0.;
+  double lastMollifyMs = 0.;
+  double lastFlipMs = 0.;
+  double lastMatrixMs = 0.;
+
+private:
+  // The tufted cover before any flips, and the input mesh edge which gives each cover edge its length
+  std::unique_ptr<SurfaceMesh> coverMesh;
+  std::vector<size_t> coverEdgeSource;
+
+  // The last intrinsic Delaunay triangulation of the cover, and the edges flipped (in order) to reach it from the cover
+  std::unique_ptr<SurfaceMesh> intrinsicMesh;
+  EdgeData<double> intrinsicEdgeLengths;
+  std::vector<size_t> flipLog;
+  size_t flipLogBaseSize = 0;
+
+  // Keep the source mesh around so a fallback rebuild can be done
+  SurfaceMesh* sourceMesh = nullptr;
+
+  std::tuple<SparseMatrix<double>, SparseMatrix<double>> buildMatrices();
+};
+
+// Flip edges until the intrinsic triangulation is Delaunay, appending the index of every flipped edge to `flipLog`.
+// Returns the number of flips performed.
+size_t flipToDelaunayRecorded(SurfaceMesh& mesh, EdgeData<double>& edgeLengths, std::vector<size_t>& flipLog,
+                              double delaunayEPS = 1e-6);
+
+// Length of the opposite diagonal of the quad around the edge of `he`, computed from the intrinsic edge lengths.
+// Returns a negative value if the quad is not convex, in which case the edge cannot be flipped.
+double flippedEdgeLength(Halfedge he, const EdgeData<double>& edgeLengths);
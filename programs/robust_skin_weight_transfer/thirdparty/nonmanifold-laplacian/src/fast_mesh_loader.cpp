@@ -0,0 +1,448 @@
+#include "fast_mesh_loader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// === File access
+
+// A read-only view of a whole file. Memory-mapped when possible, otherwise read into a buffer.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("failed to open input file " + filename);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        mapped = addr;
+        mappedSize = st.st_size;
+        ::madvise(addr, mappedSize, MADV_SEQUENTIAL);
+      }
+    }
+    ::close(fd);
+
+    if (!mapped) {
+      std::ifstream in(filename, std::ios::binary);
+      if (!in) {
+        throw std::runtime_error("failed to read input file " + filename);
+      }
+      buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+  }
+  ~MappedFile() {
+    if (mapped) ::munmap(mapped, mappedSize);
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* begin() const { return mapped ? static_cast<const char*>(mapped) : buffer.data(); }
+  const char* end() const { return begin() + (mapped ? mappedSize : buffer.size()); }
+
+private:
+  void* mapped = nullptr;
+  size_t mappedSize = 0;
+  std::vector<char> buffer;
+};
+
+// === Text parsing
+
+inline bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char* skipSpaces(const char* p, const char* end) {
+  while (p < end && isSpace(*p)) ++p;
+  return p;
+}
+
+inline const char* skipLine(const char* p, const char* end) {
+  const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+  return nl ? nl + 1 : end;
+}
+
+inline const char* lineEnd(const char* p, const char* end) {
+  const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+  return nl ? nl : end;
+}
+
+bool parseDouble(const char*& p, const char* end, double& out) {
+  p = skipSpaces(p, end);
+  if (p < end && *p == '+') ++p; // from_chars does not accept a leading '+'
+#if defined(__cpp_lib_to_chars)
+  std::from_chars_result res = std::from_chars(p, end, out);
+  if (res.ec != std::errc()) return false;
+  p = res.ptr;
+  return true;
+#else
+  // No floating-point from_chars in this standard library: copy the token so strtod cannot run past the mapping
+  char token[64];
+  size_t len = 0;
+  while (p + len < end && len < sizeof(token) - 1 && !isSpace(p[len]) && p[len] != '\n') {
+    token[len] = p[len];
+    len++;
+  }
+  token[len] = '\0';
+  char* tokenEnd = nullptr;
+  out = std::strtod(token, &tokenEnd);
+  if (tokenEnd == token) return false;
+  p += tokenEnd - token;
+  return true;
+#endif
+}
+
+template <typename T>
+bool parseInt(const char*& p, const char* end, T& out) {
+  p = skipSpaces(p, end);
+  if (p < end && *p == '+') ++p;
+  std::from_chars_result res = std::from_chars(p, end, out);
+  if (res.ec != std::errc()) return false;
+  p = res.ptr;
+  return true;
+}
+
+// === OBJ
+
+FlatMesh parseObj(const char* p, const char* end) {
+  FlatMesh mesh;
+  mesh.faceStarts.push_back(0);
+
+  while (p < end) {
+    p = skipSpaces(p, end);
+    if (p + 1 < end && p[0] == 'v' && isSpace(p[1])) {
+      p += 1;
+      for (int i = 0; i < 3; i++) {
+        double val;
+        if (!parseDouble(p, end, val)) throw std::runtime_error("malformed OBJ vertex");
+        mesh.vertexCoordinates.push_back(val);
+      }
+    } else if (p + 1 < end && p[0] == 'f' && isSpace(p[1])) {
+      p += 1;
+      const char* eol = lineEnd(p, end);
+      size_t nV = mesh.nVertices();
+      while (true) {
+        p = skipSpaces(p, eol);
+        if (p >= eol) break;
+        long long ind;
+        if (!parseInt(p, eol, ind)) throw std::runtime_error("malformed OBJ face");
+        // negative indices are relative to the end of the vertex list, positive ones are 1-based
+        size_t iV = ind < 0 ? nV + ind : static_cast<size_t>(ind - 1);
+        if (ind == 0 || iV >= nV) throw std::runtime_error("OBJ face index out of range");
+        mesh.faceIndices.push_back(iV);
+        // skip any /vt/vn suffix
+        while (p < eol && !isSpace(*p)) ++p;
+      }
+      mesh.faceStarts.push_back(mesh.faceIndices.size());
+    }
+    p = skipLine(p, end);
+  }
+
+  return mesh;
+}
+
+// === PLY
+
+enum class PlyFormat { Ascii, BinaryLittleEndian, BinaryBigEndian };
+
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid };
+
+PlyType parsePlyType(const std::string& name) {
+  if (name == "char" || name == "int8") return PlyType::Int8;
+  if (name == "uchar" || name == "uint8") return PlyType::UInt8;
+  if (name == "short" || name == "int16") return PlyType::Int16;
+  if (name == "ushort" || name == "uint16") return PlyType::UInt16;
+  if (name == "int" || name == "int32") return PlyType::Int32;
+  if (name == "uint" || name == "uint32") return PlyType::UInt32;
+  if (name == "float" || name == "float32") return PlyType::Float32;
+  if (name == "double" || name == "float64") return PlyType::Float64;
+  return PlyType::Invalid;
+}
+
+size_t plyTypeSize(PlyType type) {
+  switch (type) {
+  case PlyType::Int8:
+  case PlyType::UInt8:
+    return 1;
+  case PlyType::Int16:
+  case PlyType::UInt16:
+    return 2;
+  case PlyType::Int32:
+  case PlyType::UInt32:
+  case PlyType::Float32:
+    return 4;
+  case PlyType::Float64:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+struct PlyProperty {
+  std::string name;
+  PlyType type = PlyType::Invalid;
+  bool isList = false;
+  PlyType countType = PlyType::Invalid;
+};
+
+struct PlyElement {
+  std::string name;
+  size_t count = 0;
+  std::vector<PlyProperty> properties;
+};
+
+template <typename T>
+T loadBinary(const char* p, bool swap) {
+  T val;
+  if (swap) {
+    char bytes[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); i++) bytes[i] = p[sizeof(T) - 1 - i];
+    std::memcpy(&val, bytes, sizeof(T));
+  } else {
+    std::memcpy(&val, p, sizeof(T));
+  }
+  return val;
+}
+
+// Read one binary scalar of the given type, advancing p
+double readBinaryScalar(const char*& p, const char* end, PlyType type, bool swap) {
+  size_t size = plyTypeSize(type);
+  if (p + size > end) throw std::runtime_error("unexpected end of binary PLY data");
+  double val = 0.;
+  switch (type) {
+  case PlyType::Int8:
+    val = loadBinary<int8_t>(p, swap);
+    break;
+  case PlyType::UInt8:
+    val = loadBinary<uint8_t>(p, swap);
+    break;
+  case PlyType::Int16:
+    val = loadBinary<int16_t>(p, swap);
+    break;
+  case PlyType::UInt16:
+    val = loadBinary<uint16_t>(p, swap);
+    break;
+  case PlyType::Int32:
+    val = loadBinary<int32_t>(p, swap);
+    break;
+  case PlyType::UInt32:
+    val = loadBinary<uint32_t>(p, swap);
+    break;
+  case PlyType::Float32:
+    val = loadBinary<float>(p, swap);
+    break;
+  case PlyType::Float64:
+    val = loadBinary<double>(p, swap);
+    break;
+  default:
+    throw std::runtime_error("invalid PLY property type");
+  }
+  p += size;
+  return val;
+}
+
+// Values are rounded to the declared type, so "property float" gives the same coordinates as a binary file would
+double readAsciiScalar(const char*& p, const char* end, PlyType type) {
+  double val;
+  if (!parseDouble(p, end, val)) throw std::runtime_error("malformed ascii PLY data");
+  if (type == PlyType::Float32) return static_cast<float>(val);
+  return val;
+}
+
+// Indices at or above 2^53 cannot be told apart as doubles, and are far beyond any vertex count
+constexpr double maxPlyIndex = 9007199254740992.;
+
+FlatMesh parsePly(const char* p, const char* end) {
+
+  // == Header
+  PlyFormat format = PlyFormat::Ascii;
+  std::vector<PlyElement> elements;
+  bool sawMagic = false;
+  while (true) {
+    if (p >= end) throw std::runtime_error("PLY header is not terminated");
+    const char* eol = lineEnd(p, end);
+    std::string line(p, eol);
+    p = eol < end ? eol + 1 : end;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while (pos < line.size()) {
+      size_t start = line.find_first_not_of(" \t", pos);
+      if (start == std::string::npos) break;
+      size_t stop = line.find_first_of(" \t", start);
+      if (stop == std::string::npos) stop = line.size();
+      words.push_back(line.substr(start, stop - start));
+      pos = stop;
+    }
+    if (words.empty()) continue;
+
+    if (!sawMagic) {
+      if (words[0] != "ply") throw std::runtime_error("not a PLY file");
+      sawMagic = true;
+    } else if (words[0] == "format" && words.size() >= 2) {
+      if (words[1] == "ascii") {
+        format = PlyFormat::Ascii;
+      } else if (words[1] == "binary_little_endian") {
+        format = PlyFormat::BinaryLittleEndian;
+      } else if (words[1] == "binary_big_endian") {
+        format = PlyFormat::BinaryBigEndian;
+      } else {
+        throw std::runtime_error("unknown PLY format " + words[1]);
+      }
+    } else if (words[0] == "element" && words.size() >= 3) {
+      PlyElement elem;
+      elem.name = words[1];
+      elem.count = std::strtoull(words[2].c_str(), nullptr, 10);
+      elements.push_back(elem);
+    } else if (words[0] == "property" && !elements.empty()) {
+      PlyProperty prop;
+      if (words.size() >= 5 && words[1] == "list") {
+        prop.isList = true;
+        prop.countType = parsePlyType(words[2]);
+        prop.type = parsePlyType(words[3]);
+        prop.name = words[4];
+      } else if (words.size() >= 3) {
+        prop.type = parsePlyType(words[1]);
+        prop.name = words[2];
+      }
+      if (prop.type == PlyType::Invalid || (prop.isList && prop.countType == PlyType::Invalid)) {
+        throw std::runtime_error("unsupported PLY property: " + line);
+      }
+      elements.back().properties.push_back(prop);
+    } else if (words[0] == "end_header") {
+      break;
+    }
+  }
+
+  // == Body
+  FlatMesh mesh;
+  mesh.faceStarts.push_back(0);
+
+  const bool binary = format != PlyFormat::Ascii;
+  uint16_t endianProbe = 1;
+  const bool hostLittleEndian = *reinterpret_cast<const uint8_t*>(&endianProbe) == 1;
+  const bool swap = binary && ((format == PlyFormat::BinaryLittleEndian) != hostLittleEndian);
+
+  auto readScalar = [&](PlyType type) -> double {
+    if (binary) return readBinaryScalar(p, end, type, swap);
+    return readAsciiScalar(p, end, type);
+  };
+
+  for (const PlyElement& elem : elements) {
+    const bool isVertex = elem.name == "vertex";
+    const bool isFace = elem.name == "face";
+
+    // Map properties to what we care about: x/y/z for vertices, the index list for faces
+    std::vector<int> role(elem.properties.size(), -1);
+    for (size_t iP = 0; iP < elem.properties.size(); iP++) {
+      const PlyProperty& prop = elem.properties[iP];
+      if (isVertex && !prop.isList) {
+        if (prop.name == "x") role[iP] = 0;
+        if (prop.name == "y") role[iP] = 1;
+        if (prop.name == "z") role[iP] = 2;
+      }
+      if (isFace && prop.isList && (prop.name == "vertex_indices" || prop.name == "vertex_index")) {
+        role[iP] = 3;
+      }
+    }
+
+    // Smallest encoding of one element: binary scalars and list counts at their size, ascii values as one character
+    // and a separator. Lists may be empty.
+    bool fixedSize = binary;
+    size_t stride = 0;
+    for (const PlyProperty& prop : elem.properties) {
+      if (prop.isList) fixedSize = false;
+      stride += binary ? plyTypeSize(prop.isList ? prop.countType : prop.type) : 2;
+    }
+
+    // Elements we do not read which have a fixed size in binary files are skipped in one step
+    if (fixedSize && !isVertex && !isFace) {
+      if (static_cast<size_t>(end - p) / std::max<size_t>(stride, 1) < elem.count) {
+        throw std::runtime_error("unexpected end of binary PLY data");
+      }
+      p += stride * elem.count;
+      continue;
+    }
+
+    // The header count is not trusted for reservations: no more elements than the remaining bytes can encode
+    size_t maxCount = std::min(elem.count, static_cast<size_t>(end - p) / std::max<size_t>(stride, 1));
+    if (isVertex) mesh.vertexCoordinates.reserve(3 * maxCount);
+    if (isFace) {
+      mesh.faceStarts.reserve(maxCount + 1);
+      mesh.faceIndices.reserve(3 * maxCount);
+    }
+
+    for (size_t iE = 0; iE < elem.count; iE++) {
+      double xyz[3] = {0., 0., 0.};
+      for (size_t iP = 0; iP < elem.properties.size(); iP++) {
+        const PlyProperty& prop = elem.properties[iP];
+        if (prop.isList) {
+          double count = readScalar(prop.countType);
+          if (!(count >= 0.) || count > static_cast<double>(end - p)) {
+            throw std::runtime_error("PLY list length out of range");
+          }
+          size_t n = static_cast<size_t>(count);
+          for (size_t i = 0; i < n; i++) {
+            double ind = readScalar(prop.type);
+            if (role[iP] == 3) {
+              // Checked before the cast, which is undefined for negative or huge values
+              if (!(ind >= 0.) || ind >= maxPlyIndex) throw std::runtime_error("PLY face index out of range");
+              mesh.faceIndices.push_back(static_cast<size_t>(ind));
+            }
+          }
+          if (role[iP] == 3) mesh.faceStarts.push_back(mesh.faceIndices.size());
+        } else {
+          double val = readScalar(prop.type);
+          if (role[iP] >= 0 && role[iP] < 3) xyz[role[iP]] = val;
+        }
+      }
+      if (isVertex) {
+        mesh.vertexCoordinates.insert(mesh.vertexCoordinates.end(), xyz, xyz + 3);
+      }
+      if (!binary) p = skipLine(p, end);
+    }
+  }
+
+  size_t nV = mesh.nVertices();
+  for (size_t ind : mesh.faceIndices) {
+    if (ind >= nV) throw std::runtime_error("PLY face index out of range");
+  }
+
+  return mesh;
+}
+
+std::string lowerExtension(const std::string& filename) {
+  size_t dot = filename.find_last_of('.');
+  if (dot == std::string::npos) return "";
+  std::string ext = filename.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+  return ext;
+}
+
+} // namespace
+
+bool hasFastLoader(const std::string& filename) {
+  std::string ext = lowerExtension(filename);
+  return ext == "obj" || ext == "ply";
+}
+
+FlatMesh loadFlatMesh(const std::string& filename) {
+  MappedFile file(filename);
+  std::string ext = lowerExtension(filename);
+  if (ext == "obj") return parseObj(file.begin(), file.end());
+  if (ext == "ply") return parsePly(file.begin(), file.end());
+  throw std::runtime_error("no fast loader for " + filename);
+}
@@ -0,0 +1,328 @@
+#include "incremental_knn.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <stdexcept>
+
+IncrementalKnnIndex::IncrementalKnnIndex(double cellSize_) : cellSize(cellSize_) {
+  if (!(cellSize > 0.)) {
+    throw std::runtime_error("IncrementalKnnIndex cell size must be positive");
+  }
+}
+
+IncrementalKnnIndex::IncrementalKnnIndex(const std::vector<Vector3>& points, size_t k) : cellSize(1.) {
+  if (!points.empty()) {
+    Vector3 bboxMin = points[0];
+    Vector3 bboxMax = points[0];
+    for (const Vector3& p : points) {
+      bboxMin = componentwiseMin(bboxMin, p);
+      bboxMax = componentwiseMax(bboxMax, p);
+    }
+    double diag = norm(bboxMax - bboxMin);
+
+    // Points on a surface: the number in a cell grows with its area
+    double size = diag * std::sqrt(static_cast<double>(std::max<size_t>(k, 1)) / points.size());
+    if (size > 0. && std::isfinite(size)) cellSize = size;
+  }
+
+  positions.reserve(points.size());
+  alive.reserve(points.size());
+  for (const Vector3& p : points) {
+    insert(p);
+  }
+}
+
+IncrementalKnnIndex::CellCoord IncrementalKnnIndex::cellOf(Vector3 p) const {
+  return {static_cast<int64_t>(std::floor(p.x / cellSize)), static_cast<int64_t>(std::floor(p.y / cellSize)),
+          static_cast<int64_t>(std::floor(p.z / cellSize))};
+}
+
+const std::vector<size_t>* IncrementalKnnIndex::cellPoints(const CellCoord& c) const {
+  auto it = cells.find(c);
+  return it == cells.end() ? nullptr : &it->second;
+}
+
+void IncrementalKnnIndex::forEachCell(
+    const std::function<void(const CellCoord&, const std::vector<size_t>&)>& fn) const {
+  for (const auto& cell : cells) {
+    fn(cell.first, cell.second);
+  }
+}
+
+double IncrementalKnnIndex::distanceToCell(Vector3 p, const CellCoord& c) const {
+  double d2 = 0.;
+  const double coords[3] = {p.x, p.y, p.z};
+  for (int i = 0; i < 3; i++) {
+    double lo = c[i] * cellSize;
+    double hi = lo + cellSize;
+    double d = coords[i] < lo ? lo - coords[i] : (coords[i] > hi ? coords[i] - hi : 0.);
+    d2 += d * d;
+  }
+  return std::sqrt(d2);
+}
+
+void IncrementalKnnIndex::refreshBounds() const {
+  if (!boundsStale) return;
+  boundsStale = false;
+  cellMin = {0, 0, 0};
+  cellMax = {-1, -1, -1};
+  bool first = true;
+  for (const auto& cell : cells) {
+    for (int i = 0; i < 3; i++) {
+      cellMin[i] = first ? cell.first[i] : std::min(cellMin[i], cell.first[i]);
+      cellMax[i] = first ? cell.first[i] : std::max(cellMax[i], cell.first[i]);
+    }
+    first = false;
+  }
+}
+
+size_t IncrementalKnnIndex::insert(Vector3 position) {
+  size_t id = positions.size();
+  positions.push_back(position);
+  alive.push_back(true);
+  aliveCount++;
+
+  CellCoord c = cellOf(position);
+  cells[c].push_back(id);
+
+  refreshBounds();
+  if (cellMax[0] < cellMin[0]) { // first point
+    cellMin = c;
+    cellMax = c;
+  } else {
+    for (int i = 0; i < 3; i++) {
+      cellMin[i] = std::min(cellMin[i], c[i]);
+      cellMax[i] = std::max(cellMax[i], c[i]);
+    }
+  }
+
+  return id;
+}
+
+void IncrementalKnnIndex::remove(size_t id) {
+  if (!isAlive(id)) return;
+  alive[id] = false;
+  aliveCount--;
+
+  CellCoord c = cellOf(positions[id]);
+  auto it = cells.find(c);
+  if (it == cells.end()) return;
+  std::vector<size_t>& bucket = it->second;
+  auto pos = std::find(bucket.begin(), bucket.end(), id);
+  if (pos != bucket.end()) {
+    *pos = bucket.back();
+    bucket.pop_back();
+  }
+  if (bucket.empty()) {
+    cells.erase(it);
+    // The occupied bounds only shrink when a cell on the boundary empties
+    for (int i = 0; i < 3; i++) {
+      if (c[i] == cellMin[i] || c[i] == cellMax[i]) boundsStale = true;
+    }
+  }
+}
+
+std::vector<size_t> IncrementalKnnIndex::kNearestNeighbors(Vector3 query, size_t k, size_t exclude) const {
+  if (k == 0 || aliveCount == 0) return {};
+
+  // Max-heap of the best candidates so far, by squared distance
+  using Candidate = std::pair<double, size_t>;
+  std::priority_queue<Candidate> best;
+
+  refreshBounds();
+  CellCoord center = cellOf(query);
+  int64_t maxRing = 0;
+  for (int i = 0; i < 3; i++) {
+    maxRing = std::max({maxRing, center[i] - cellMin[i], cellMax[i] - center[i]});
+  }
+
+  auto visitCell = [&](const CellCoord& c) {
+    auto it = cells.find(c);
+    if (it == cells.end()) return;
+    for (size_t id : it->second) {
+      if (id == exclude) continue;
+      double d2 = norm2(positions[id] - query);
+      if (best.size() < k) {
+        best.emplace(d2, id);
+      } else if (d2 < best.top().first) {
+        best.pop();
+        best.emplace(d2, id);
+      }
+    }
+  };
+
+  // Visit shells of cells at increasing Chebyshev distance. After ring r, every unvisited point is at least r cells
+  // away, so we can stop once the k-th best is within that distance.
+  for (int64_t r = 0; r <= maxRing; r++) {
+    for (int64_t dx = -r; dx <= r; dx++) {
+      for (int64_t dy = -r; dy <= r; dy++) {
+        bool onShellXY = std::abs(dx) == r || std::abs(dy) == r;
+        for (int64_t dz = -r; dz <= r; dz += (onShellXY ? 1 : std::max<int64_t>(2 * r, 1))) {
+          visitCell({center[0] + dx, center[1] + dy, center[2] + dz});
+        }
+      }
+    }
+
+    if (best.size() == k && std::sqrt(best.top().first) <= r * cellSize) break;
+  }
+
+  std::vector<size_t> result(best.size());
+  for (size_t i = result.size(); i > 0; i--) {
+    result[i - 1] = best.top().second;
+    best.pop();
+  }
+  return result;
+}
+
+std::vector<size_t> IncrementalKnnIndex::kNearestNeighbors(size_t id, size_t k) const {
+  return kNearestNeighbors(positions[id], k, id);
+}
+
+Neighbors_t IncrementalKnnIndex::kNearestNeighborsBatch(const std::vector<size_t>& ids, size_t k) const {
+  Neighbors_t result(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    result[i] = kNearestNeighbors(ids[i], k);
+  }
+  return result;
+}
+
+std::vector<size_t> IncrementalKnnIndex::radiusSearch(Vector3 query, double radius) const {
+  std::vector<size_t> result;
+  if (aliveCount == 0 || !(radius >= 0.)) return result;
+
+  refreshBounds();
+  CellCoord lo = cellOf(query - Vector3{radius, radius, radius});
+  CellCoord hi = cellOf(query + Vector3{radius, radius, radius});
+  for (int i = 0; i < 3; i++) {
+    lo[i] = std::max(lo[i], cellMin[i]);
+    hi[i] = std::min(hi[i], cellMax[i]);
+  }
+
+  double r2 = radius * radius;
+  for (int64_t x = lo[0]; x <= hi[0]; x++) {
+    for (int64_t y = lo[1]; y <= hi[1]; y++) {
+      for (int64_t z = lo[2]; z <= hi[2]; z++) {
+        auto it = cells.find(CellCoord{x, y, z});
+        if (it == cells.end()) continue;
+        for (size_t id : it->second) {
+          if (norm2(positions[id] - query) <= r2) result.push_back(id);
+        }
+      }
+    }
+  }
+
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+IncrementalNeighborhoods::IncrementalNeighborhoods(const IncrementalKnnIndex& index_, size_t k_)
+    : index(index_), k(k_) {
+  neigh.resize(index.nIds());
+  kthDistance.assign(index.nIds(), std::numeric_limits<double>::infinity());
+  for (size_t id = 0; id < index.nIds(); id++) {
+    if (index.isAlive(id)) recompute(id);
+  }
+}
+
+void IncrementalNeighborhoods::recompute(size_t id) {
+  neigh[id] = index.kNearestNeighbors(id, k);
+  const std::vector<size_t>& thisNeigh = neigh[id];
+  double d = (thisNeigh.size() < k || thisNeigh.empty()) ? std::numeric_limits<double>::infinity()
+                                                          : norm(index.position(thisNeigh.back()) - index.position(id));
+  kthDistance[id] = d;
+
+  double& cellBound = cellKthBound[index.cellOf(index.position(id))];
+  cellBound = std::max(cellBound, d);
+  globalKthBound = std::max(globalKthBound, d);
+}
+
+// Visit every alive point q with |p - q| <= kthDistance[q], other than those marked in `skip`. Cells whose bound is
+// below their distance to p are pruned, and the bounds of the cells which are scanned are tightened on the way.
+void IncrementalNeighborhoods::collectAffected(Vector3 p, const std::vector<char>& skip,
+                                               const std::function<void(size_t)>& visit) {
+  auto visitCell = [&](const IncrementalKnnIndex::CellCoord& c, const std::vector<size_t>& points) {
+    auto bound = cellKthBound.find(c);
+    if (bound == cellKthBound.end() || bound->second < index.distanceToCell(p, c)) return;
+    double exact = 0.;
+    for (size_t q : points) {
+      if (skip[q]) continue;
+      lastPointsTested++;
+      if (norm(index.position(q) - p) <= kthDistance[q]) visit(q);
+      exact = std::max(exact, kthDistance[q]);
+    }
+    bound->second = exact;
+  };
+
+  // Only cells within the largest k-th distance can hold an affected point. Walk that cube of cells, unless it has
+  // more cells than are occupied.
+  double cellSize = index.getCellSize();
+  double rings = std::ceil(globalKthBound / cellSize) + 1.;
+  double cubeCells = std::pow(2. * rings + 1., 3.);
+  if (!std::isfinite(cubeCells) || cubeCells > static_cast<double>(index.nCells())) {
+    index.forEachCell(visitCell);
+    return;
+  }
+  IncrementalKnnIndex::CellCoord center = index.cellOf(p);
+  int64_t r = static_cast<int64_t>(rings);
+  for (int64_t dx = -r; dx <= r; dx++) {
+    for (int64_t dy = -r; dy <= r; dy++) {
+      for (int64_t dz = -r; dz <= r; dz++) {
+        IncrementalKnnIndex::CellCoord c{center[0] + dx, center[1] + dy, center[2] + dz};
+        if (const std::vector<size_t>* points = index.cellPoints(c)) visitCell(c, *points);
+      }
+    }
+  }
+}
+
+std::vector<size_t> IncrementalNeighborhoods::update(const std::vector<size_t>& insertedIds,
+                                                     const std::vector<size_t>& removedIds) {
+  neigh.resize(index.nIds());
+  kthDistance.resize(index.nIds(), std::numeric_limits<double>::infinity());
+  lastPointsTested = 0;
+
+  // New points are recomputed anyway, and their distances are not known yet
+  std::vector<char> skip(index.nIds(), false);
+  std::vector<char> dirty(index.nIds(), false);
+  for (size_t id : insertedIds) {
+    skip[id] = true;
+    dirty[id] = true;
+  }
+
+  for (size_t id : insertedIds) {
+    collectAffected(index.position(id), skip, [&](size_t q) { dirty[q] = true; });
+  }
+
+  // Removed points are only in the neighborhoods of points which are at least as far from their k-th neighbor
+  for (size_t id : removedIds) {
+    collectAffected(index.position(id), skip, [&](size_t q) {
+      const std::vector<size_t>& otherNeigh = neigh[q];
+      if (std::find(otherNeigh.begin(), otherNeigh.end(), id) != otherNeigh.end()) dirty[q] = true;
+    });
+  }
+  for (size_t id : removedIds) {
+    neigh[id].clear();
+    kthDistance[id] = 0.;
+    IncrementalKnnIndex::CellCoord c = index.cellOf(index.position(id));
+    if (index.cellPoints(c) == nullptr) cellKthBound.erase(c);
+  }
+
+  std::vector<size_t> dirtyIds;
+  for (size_t id = 0; id < dirty.size(); id++) {
+    if (dirty[id] && index.isAlive(id)) dirtyIds.push_back(id);
+  }
+
+  // A point with fewer than k neighbors had an infinite bound; once it has k, the global bound can come down again
+  bool refreshGlobal = !std::isfinite(globalKthBound);
+  for (size_t id : dirtyIds) {
+    recompute(id);
+  }
+  if (refreshGlobal) {
+    globalKthBound = 0.;
+    for (const auto& bound : cellKthBound) {
+      globalKthBound = std::max(globalKthBound, bound.second);
+    }
+  }
+
+  return dirtyIds;
+}
@@ -0,0 +1,377 @@
+#include "nonmanifold_tests.h"
+#include "fast_mesh_loader.h"
+#include "incremental_knn.h"
+#include "tufted_laplacian_cache.h"
+
+#include "geometrycentral/surface/halfedge_factories.h"
+#include "geometrycentral/surface/simple_polygon_mesh.h"
+#include "geometrycentral/surface/tufted_laplacian.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+using namespace geometrycentral;
+using namespace geometrycentral::surface;
+
+namespace {
+
+// Small deterministic generator, so failures are reproducible
+struct TestRandom {
+  uint64_t state = 0x2545F4914F6CDD1Dull;
+  double next() { // in [-1, 1)
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return static_cast<double>(state >> 11) * (2. / 9007199254740992.) - 1.;
+  }
+};
+
+// A jittered n x n grid in the xy plane, with two fins hanging off one interior edge so that edge has four faces
+void makeFinnedGrid(size_t n, std::vector<std::vector<size_t>>& polygons, std::vector<Vector3>& positions) {
+  TestRandom rand;
+  for (size_t j = 0; j < n; j++) {
+    for (size_t i = 0; i < n; i++) {
+      positions.push_back(Vector3{i + 0.25 * rand.next(), j + 0.25 * rand.next(), 0.1 * rand.next()});
+    }
+  }
+  for (size_t j = 0; j + 1 < n; j++) {
+    for (size_t i = 0; i + 1 < n; i++) {
+      size_t a = j * n + i;
+      polygons.push_back({a, a + 1, a + n + 1});
+      polygons.push_back({a, a + n + 1, a + n});
+    }
+  }
+
+  size_t a = (n / 2) * n + n / 2;
+  size_t b = a + 1;
+  positions.push_back(Vector3{n / 2 + 0.5, n / 2 + 0.2, 1.});
+  positions.push_back(Vector3{n / 2 + 0.5, n / 2 - 0.3, -1.});
+  polygons.push_back({a, b, positions.size() - 2});
+  polygons.push_back({b, a, positions.size() - 1});
+}
+
+// Relative difference between two sparse matrices, in the Frobenius norm
+double relativeDifference(const SparseMatrix<double>& a, const SparseMatrix<double>& b) {
+  if (a.rows() != b.rows() || a.cols() != b.cols()) return INFINITY;
+  SparseMatrix<double> diff = a - b;
+  return diff.norm() / std::max(b.norm(), 1e-300);
+}
+
+bool matchesReference(const char* what, const std::vector<std::vector<size_t>>& polygons,
+                      const std::vector<Vector3>& positions, double mollifyFactor, const SparseMatrix<double>& L,
+                      const SparseMatrix<double>& M) {
+  std::unique_ptr<SurfaceMesh> mesh;
+  std::unique_ptr<VertexPositionGeometry> geom;
+  std::tie(mesh, geom) = makeGeneralHalfedgeAndGeometry(polygons, positions);
+  SparseMatrix<double> refL, refM;
+  std::tie(refL, refM) = buildTuftedLaplacian(*mesh, *geom, mollifyFactor);
+
+  double dL = relativeDifference(L, refL);
+  double dM = relativeDifference(M, refM);
+  if (!(dL < 1e-6) || !(dM < 1e-6)) {
+    std::cerr << what << ": differs from buildTuftedLaplacian (L " << dL << ", M " << dM << ")" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Write `contents` to `filename`, returning false if the file cannot be created
+bool writeFile(const std::string& filename, const std::string& contents) {
+  std::ofstream out(filename, std::ios::binary);
+  out.write(contents.data(), contents.size());
+  return static_cast<bool>(out);
+}
+
+void appendLittleEndian(std::string& out, const void* value, size_t size) {
+  unsigned char bytes[8];
+  std::memcpy(bytes, value, size);
+  const uint16_t probe = 1;
+  bool hostLittleEndian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+  for (size_t i = 0; i < size; i++) {
+    out.push_back(static_cast<char>(bytes[hostLittleEndian ? i : size - 1 - i]));
+  }
+}
+
+// Load `contents` with both loaders and compare the results
+bool loadersAgree(const char* what, const std::string& filename, const std::string& contents) {
+  if (!writeFile(filename, contents)) {
+    std::cerr << what << ": skipped, cannot write " << filename << std::endl;
+    return true;
+  }
+
+  bool ok = true;
+  try {
+    FlatMesh flat = loadFlatMesh(filename);
+    SimplePolygonMesh reference(filename);
+
+    if (flat.nVertices() != reference.nVertices() || flat.nFaces() != reference.nFaces()) {
+      std::cerr << what << ": loaded " << flat.nVertices() << " vertices and " << flat.nFaces() << " faces, expected "
+                << reference.nVertices() << " and " << reference.nFaces() << std::endl;
+      ok = false;
+    }
+    for (size_t iV = 0; ok && iV < flat.nVertices(); iV++) {
+      for (size_t j = 0; j < 3; j++) {
+        if (flat.vertexCoordinates[3 * iV + j] != reference.vertexCoordinates[iV][j]) {
+          std::cerr << what << ": vertex " << iV << " differs" << std::endl;
+          ok = false;
+          break;
+        }
+      }
+    }
+    for (size_t iF = 0; ok && iF < flat.nFaces(); iF++) {
+      std::vector<size_t> face(flat.faceIndices.begin() + flat.faceStarts[iF],
+                               flat.faceIndices.begin() + flat.faceStarts[iF + 1]);
+      if (face != reference.polygons[iF]) {
+        std::cerr << what << ": face " << iF << " differs" << std::endl;
+        ok = false;
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << what << ": " << e.what() << std::endl;
+    ok = false;
+  }
+
+  std::remove(filename.c_str());
+  return ok;
+}
+
+// Check that loadFlatMesh() throws on `contents` instead of returning a mesh
+bool loaderRejects(const char* what, const std::string& filename, const std::string& contents) {
+  if (!writeFile(filename, contents)) {
+    std::cerr << what << ": skipped, cannot write " << filename << std::endl;
+    return true;
+  }
+
+  bool rejected = false;
+  try {
+    loadFlatMesh(filename);
+  } catch (const std::runtime_error&) {
+    rejected = true;
+  }
+
+  std::remove(filename.c_str());
+  if (!rejected) std::cerr << what << ": malformed file was accepted" << std::endl;
+  return rejected;
+}
+
+std::string plyHeader(const char* format, size_t nVertices, size_t nFaces, const char* indexType = "int") {
+  return std::string("ply\nformat ") + format + " 1.0\ncomment nonmanifold loader test\n" +
+         "element vertex " + std::to_string(nVertices) + "\nproperty float x\nproperty float y\nproperty float z\n" +
+         "element face " + std::to_string(nFaces) + "\nproperty list uchar " + indexType + " vertex_indices\n" +
+         "end_header\n";
+}
+
+// Distances from `query` to its k nearest alive points other than `exclude`, by brute force
+std::vector<double> bruteForceKnnDistances(const IncrementalKnnIndex& index, Vector3 query, size_t k, size_t exclude) {
+  std::vector<double> dists;
+  for (size_t id = 0; id < index.nIds(); id++) {
+    if (id != exclude && index.isAlive(id)) dists.push_back(norm(index.position(id) - query));
+  }
+  std::sort(dists.begin(), dists.end());
+  if (dists.size() > k) dists.resize(k);
+  return dists;
+}
+
+// Check one neighborhood against brute force. Ties make the ids ambiguous, so the distances are compared.
+bool neighborhoodMatches(const char* what, const IncrementalKnnIndex& index, size_t id,
+                         const std::vector<size_t>& neighbors, size_t k) {
+  std::vector<double> expected = bruteForceKnnDistances(index, index.position(id), k, id);
+  std::vector<size_t> unique = neighbors;
+  std::sort(unique.begin(), unique.end());
+  bool ok = neighbors.size() == expected.size() && std::adjacent_find(unique.begin(), unique.end()) == unique.end();
+  for (size_t i = 0; ok && i < neighbors.size(); i++) {
+    ok = index.isAlive(neighbors[i]) && neighbors[i] != id &&
+         norm(index.position(neighbors[i]) - index.position(id)) == expected[i];
+  }
+  if (!ok) std::cerr << what << ": wrong neighborhood for point " << id << std::endl;
+  return ok;
+}
+
+} // namespace
+
+bool testTuftedLaplacianCache() {
+  std::vector<std::vector<size_t>> polygons;
+  std::vector<Vector3> positions;
+  makeFinnedGrid(6, polygons, positions);
+  const double mollifyFactor = 1e-5;
+
+  std::unique_ptr<SurfaceMesh> mesh;
+  std::unique_ptr<VertexPositionGeometry> geom;
+  std::tie(mesh, geom) = makeGeneralHalfedgeAndGeometry(polygons, positions);
+
+  TuftedLaplacianCache cache;
+  cache.mollifyFactor = mollifyFactor;
+  SparseMatrix<double> L, M;
+  std::tie(L, M) = cache.build(*mesh, *geom);
+  if (!matchesReference("build", polygons, positions, mollifyFactor, L, M)) return false;
+
+  // Deform a little at a time, so the recorded flips stay valid and the face ordering around the nonmanifold edge
+  // does not change
+  TestRandom rand;
+  for (int step = 0; step < 4; step++) {
+    for (Vector3& p : positions) {
+      p += Vector3{0.05 * rand.next(), 0.05 * rand.next(), 0.05 * rand.next()};
+    }
+    std::tie(L, M) = cache.update(positions);
+    if (!matchesReference("update", polygons, positions, mollifyFactor, L, M)) return false;
+  }
+
+  // A flip log which may not grow at all rebuilds whenever the log is non-empty, including when it only holds the
+  // flips recorded by build(). After any build() or update() the log holds the replayed and the new flips.
+  cache.maxFlipLogGrowth = 0.;
+  bool rebuilt = false;
+  for (int step = 0; step < 4; step++) {
+    size_t flipLogSize = cache.lastReplayedFlips + cache.lastNewFlips;
+    for (Vector3& p : positions) {
+      p += Vector3{0.1 * rand.next(), 0.1 * rand.next(), 0.};
+    }
+    std::tie(L, M) = cache.update(positions);
+    if (!matchesReference("update with rebuild", polygons, positions, mollifyFactor, L, M)) return false;
+    if (flipLogSize > 0 && !cache.lastWasRebuild) {
+      std::cerr << "update with rebuild: a flip log of " << flipLogSize << " flips did not force a rebuild"
+                << std::endl;
+      return false;
+    }
+    rebuilt = rebuilt || cache.lastWasRebuild;
+  }
+  if (!rebuilt) {
+    std::cerr << "update with rebuild: the fallback rebuild was never taken" << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool testFastMeshLoader() {
+  bool ok = true;
+
+  // Triangles and a quad, with texture/normal indices and comments
+  ok &= loadersAgree("OBJ", "nonmanifold_test_mesh.obj",
+                     "# test mesh\n"
+                     "v 0 0 0\nv 1 0 0\nv 1 1 0.5\nv 0 1 -0.25\nv 0.5 0.5 1e-3\n"
+                     "vt 0 0\n"
+                     "f 1 2 5\nf 2/1 3/1 5/1\nf 3//1 4//1 5//1\n"
+                     "f 1 2 3 4\n");
+
+  const float vertices[5][3] = {
+      {0.f, 0.f, 0.f}, {1.f, 0.f, 0.f}, {1.f, 1.f, .5f}, {0.f, 1.f, -.25f}, {.5f, .5f, 1e-3f}};
+  const std::vector<std::vector<int32_t>> faces = {{0, 1, 4}, {1, 2, 4}, {2, 3, 4}, {0, 1, 2, 3}};
+
+  std::string ascii = plyHeader("ascii", 5, faces.size());
+  for (const auto& v : vertices) {
+    ascii += std::to_string(v[0]) + " " + std::to_string(v[1]) + " " + std::to_string(v[2]) + "\n";
+  }
+  for (const auto& f : faces) {
+    ascii += std::to_string(f.size());
+    for (int32_t ind : f) ascii += " " + std::to_string(ind);
+    ascii += "\n";
+  }
+  ok &= loadersAgree("ascii PLY", "nonmanifold_test_mesh.ply", ascii);
+
+  std::string binary = plyHeader("binary_little_endian", 5, faces.size());
+  for (const auto& v : vertices) {
+    for (float c : v) appendLittleEndian(binary, &c, sizeof(c));
+  }
+  for (const auto& f : faces) {
+    binary.push_back(static_cast<char>(f.size()));
+    for (int32_t ind : f) appendLittleEndian(binary, &ind, sizeof(ind));
+  }
+  ok &= loadersAgree("binary PLY", "nonmanifold_test_mesh.ply", binary);
+
+  // Malformed files must be rejected before any index is used
+  std::string vertexBlock = "0 0 0\n1 0 0\n0 1 0\n";
+  ok &= loaderRejects("negative PLY index", "nonmanifold_test_bad.ply",
+                      plyHeader("ascii", 3, 1) + vertexBlock + "3 0 1 -1\n");
+  ok &= loaderRejects("PLY index past the vertices", "nonmanifold_test_bad.ply",
+                      plyHeader("ascii", 3, 1) + vertexBlock + "3 0 1 3\n");
+  ok &= loaderRejects("huge PLY index", "nonmanifold_test_bad.ply",
+                      plyHeader("ascii", 3, 1, "double") + vertexBlock + "3 0 1 1e300\n");
+  ok &= loaderRejects("PLY face count larger than the file", "nonmanifold_test_bad.ply",
+                      plyHeader("binary_little_endian", 0, 1000000000) + std::string(4, '\0'));
+
+  return ok;
+}
+
+bool testIncrementalKnn() {
+  const size_t k = 8;
+  TestRandom rand;
+  auto randomPoint = [&]() { return Vector3{8. + 8. * rand.next(), 8. + 8. * rand.next(), 8. + 8. * rand.next()}; };
+
+  // A cluster 2^21 cells away from the main one: with coordinates packed into 21 bits per axis both used to share
+  // cells, and points showed up twice in the results
+  IncrementalKnnIndex index(1.);
+  for (size_t i = 0; i < 600; i++) index.insert(randomPoint());
+  for (size_t i = 0; i < 20; i++) index.insert(Vector3{2097152. + 2. * rand.next(), 2. * rand.next(), rand.next()});
+
+  bool ok = true;
+  for (size_t id = 0; ok && id < index.nIds(); id++) {
+    ok = neighborhoodMatches("kNearestNeighbors", index, id, index.kNearestNeighbors(id, k), k);
+  }
+
+  Vector3 query{8., 8., 8.};
+  std::vector<size_t> expectedInRadius;
+  for (size_t id = 0; id < index.nIds(); id++) {
+    if (norm(index.position(id) - query) <= 2.5) expectedInRadius.push_back(id);
+  }
+  if (index.radiusSearch(query, 2.5) != expectedInRadius) {
+    std::cerr << "radiusSearch: differs from brute force" << std::endl;
+    ok = false;
+  }
+
+  // Remove and insert points in batches, including the whole far cluster, and keep the neighborhoods up to date
+  IncrementalNeighborhoods neighborhoods(index, k);
+  for (int round = 0; ok && round < 6; round++) {
+    std::vector<size_t> removed, inserted;
+    for (size_t id = round; id < index.nIds(); id += 37) {
+      if (index.isAlive(id)) {
+        index.remove(id);
+        removed.push_back(id);
+      }
+    }
+    if (round == 0) {
+      for (size_t id = 600; id < 620; id++) {
+        if (index.isAlive(id)) {
+          index.remove(id);
+          removed.push_back(id);
+        }
+      }
+    }
+    for (size_t i = 0; i < 20; i++) inserted.push_back(index.insert(randomPoint()));
+
+    std::vector<size_t> dirty = neighborhoods.update(inserted, removed);
+    for (size_t id = 0; ok && id < index.nIds(); id++) {
+      if (!index.isAlive(id)) {
+        ok = neighborhoods.neighbors()[id].empty();
+        if (!ok) std::cerr << "IncrementalNeighborhoods: removed point " << id << " kept a neighborhood" << std::endl;
+      } else {
+        ok = neighborhoodMatches("IncrementalNeighborhoods", index, id, neighborhoods.neighbors()[id], k);
+      }
+    }
+    for (size_t id : inserted) {
+      if (ok && std::find(dirty.begin(), dirty.end(), id) == dirty.end()) {
+        std::cerr << "IncrementalNeighborhoods: inserted point " << id << " not reported" << std::endl;
+        ok = false;
+      }
+    }
+  }
+
+  // A single insertion only looks at the points around it
+  if (ok) {
+    size_t id = index.insert(Vector3{8., 8., 8.});
+    neighborhoods.update({id}, {});
+    ok = neighborhoodMatches("IncrementalNeighborhoods", index, id, neighborhoods.neighbors()[id], k);
+    if (ok && neighborhoods.lastPointsTested * 4 > index.nAlive()) {
+      std::cerr << "IncrementalNeighborhoods: a single insertion tested " << neighborhoods.lastPointsTested << " of "
+                << index.nAlive() << " points" << std::endl;
+      ok = false;
+    }
+  }
+
+  return ok;
+}
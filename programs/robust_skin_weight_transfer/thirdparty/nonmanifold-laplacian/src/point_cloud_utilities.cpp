@@ -5,6 +5,7 @@
 
 #include "Eigen/Dense"
 
+#include <algorithm>
 #include <cfloat>
 #include <numeric>
 
@@ -94,6 +95,111 @@ std::vector<std::vector<Vector2>> generate_coords_projection(const std::vector<V
   return coords;
 }
 
+// Estimate the normal at one point from its neighborhood (arbitrarily oriented), as generate_normals() does for all
+// points
+static Vector3 estimate_normal(const std::vector<Vector3>& points, const std::vector<size_t>& thisNeigh) {
+  size_t nNeigh = thisNeigh.size();
+
+  // Compute centroid
+  Vector3 center{0., 0., 0.};
+  for (size_t iN = 0; iN < nNeigh; iN++) {
+    center += points[thisNeigh[iN]];
+  }
+  center /= nNeigh + 1;
+
+  // Assemble matrix os vectors from centroid
+  Eigen::MatrixXd localMat(3, nNeigh);
+  for (size_t iN = 0; iN < nNeigh; iN++) {
+    Vector3 neighPos = points[thisNeigh[iN]] - center;
+    localMat(0, iN) = neighPos.x;
+    localMat(1, iN) = neighPos.y;
+    localMat(2, iN) = neighPos.z;
+  }
+
+  // Smallest singular vector is best normal
+  Eigen::JacobiSVD<Eigen::MatrixXd> svd(localMat, Eigen::ComputeThinU);
+  Eigen::Vector3d bestNormal = svd.matrixU().col(2);
+
+  Vector3 N{bestNormal(0), bestNormal(1), bestNormal(2)};
+  return unit(N);
+}
+
+// Project one neighborhood to the tangent plane of its center point, as generate_coords_projection() does for all
+// points
+static std::vector<Vector2> project_neighborhood(const std::vector<Vector3>& points, size_t iPt, Vector3 normal,
+                                                 const std::vector<size_t>& thisNeigh) {
+  size_t nNeigh = thisNeigh.size();
+  std::vector<Vector2> coords(nNeigh);
+  Vector3 center = points[iPt];
+
+  // build an arbitrary tangent basis
+  Vector3 basisX, basisY;
+  auto r = normal.buildTangentBasis();
+  basisX = r[0];
+  basisY = r[1];
+
+  for (size_t iN = 0; iN < nNeigh; iN++) {
+    Vector3 vec = points[thisNeigh[iN]] - center;
+    vec = vec.removeComponent(normal);
+
+    Vector2 coord{dot(basisX, vec), dot(basisY, vec)};
+    coords[iN] = coord;
+  }
+
+  return coords;
+}
+
+Neighbors_t generate_knn_adaptive(const std::vector<Vector3>& points, size_t kMin, size_t kMax, double* avgDegree) {
+
+  kMax = std::min(kMax, points.size() > 0 ? points.size() - 1 : 0);
+  kMin = std::min(std::max<size_t>(kMin, 3), kMax);
+
+  geometrycentral::NearestNeighborFinder finder(points);
+
+  Neighbors_t result(points.size());
+  size_t degreeSum = 0;
+  for (size_t iPt = 0; iPt < points.size(); iPt++) {
+
+    // Query the largest neighborhood once, and sort it by distance so prefixes are the nearest neighbors
+    std::vector<size_t> candidates = finder.kNearestNeighbors(iPt, kMax);
+    std::vector<double> candidateDist(candidates.size());
+    for (size_t iN = 0; iN < candidates.size(); iN++) {
+      candidateDist[iN] = norm(points[candidates[iN]] - points[iPt]);
+    }
+    std::vector<size_t> order(candidates.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return candidateDist[a] < candidateDist[b]; });
+
+    size_t k = std::min(kMin, candidates.size());
+    std::vector<size_t> thisNeigh;
+    while (true) {
+      thisNeigh.resize(k);
+      for (size_t iN = 0; iN < k; iN++) {
+        thisNeigh[iN] = candidates[order[iN]];
+      }
+      if (k >= candidates.size()) break;
+
+      // Stop growing once the fan is closed and all its circumcircles lie within the neighborhood radius: a circle
+      // through the center point with radius R stays within 2R of it
+      Vector3 normal = estimate_normal(points, thisNeigh);
+      LocalFanResult fan = build_delaunay_fan(project_neighborhood(points, iPt, normal, thisNeigh));
+      double radius = candidateDist[order[k - 1]];
+      if (fan.closed && 2. * fan.maxCircumradius <= radius) break;
+
+      k = std::min(k + std::max<size_t>(k / 2, 2), candidates.size());
+    }
+
+    degreeSum += thisNeigh.size();
+    result[iPt] = std::move(thisNeigh);
+  }
+
+  if (avgDegree) {
+    *avgDegree = points.empty() ? 0. : static_cast<double>(degreeSum) / points.size();
+  }
+
+  return result;
+}
+
 // For each planar-projected neighborhood, generate the triangles in the Delaunay triangulation which are incident on
 // the center vertex.
 //
@@ -299,3 +405,31 @@ LocalTriangulationResult build_delaunay_triangulations(const std::vector<std::ve
 
   return result;
 }
+
+// Triangulate a single neighborhood with build_delaunay_triangulations(), and report whether the fan winds all the way
+// around the center. The triangles are found in angular order, each one starting where the previous one ended, so the
+// fan is closed when that chain comes back to its start without a gap.
+LocalFanResult build_delaunay_fan(const std::vector<Vector2>& coords) {
+
+  std::vector<size_t> localInds(coords.size());
+  std::iota(localInds.begin(), localInds.end(), 0);
+  LocalFanResult fan;
+  fan.triangles = build_delaunay_triangulations({coords}, {localInds}).pointTriangles[0];
+
+  size_t nTri = fan.triangles.size();
+  fan.closed = nTri >= 3;
+  for (size_t iTri = 0; iTri < nTri; iTri++) {
+    const std::array<size_t, 3>& tri = fan.triangles[iTri];
+    if (tri[2] != fan.triangles[(iTri + 1) % nTri][1]) fan.closed = false;
+
+    // Circumradius of the triangle with the center at the origin
+    Vector2 a = coords[tri[1]];
+    Vector2 b = coords[tri[2]];
+    double area2 = std::fabs(cross(a, b));
+    double circumradius = area2 > 0. ? norm(a) * norm(b) * norm(a - b) / (2. * area2)
+                                     : std::numeric_limits<double>::infinity();
+    fan.maxCircumradius = std::fmax(fan.maxCircumradius, circumradius);
+  }
+
+  return fan;
+}
@@ -1,5 +1,8 @@
 #include "bubble_offset.h"
+#include "fast_mesh_loader.h"
 #include "point_cloud_utilities.h"
+#include "process_mesh.h"
+#include "tufted_laplacian_cache.h"
 #include "utils.hpp"
 
 #include "geometrycentral/numerical/linear_algebra_utilities.h"
@@ -14,6 +17,9 @@
 #include "geometrycentral/surface/tufted_laplacian.h"
 #include "geometrycentral/surface/vertex_position_geometry.h"
 
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
 #include <sstream>
 
 using namespace geometrycentral;
@@ -30,6 +36,65 @@ unsigned int nNeigh = 30;
 double laplacianReplaceVal = 1.;
 double massReplaceVal = -1e-3;
 
+// Cached tufted Laplacian, see tuftedLaplacianBuild()
+std::unique_ptr<SurfaceMesh> cachedMesh;
+std::unique_ptr<VertexPositionGeometry> cachedGeometry;
+std::unique_ptr<TuftedLaplacianCache> tuftedLaplacianCache;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Milliseconds elapsed since `start`, and restart the measurement
+double lapMs(Clock::time_point& start) {
+  Clock::time_point now = Clock::now();
+  double ms = std::chrono::duration<double, std::milli>(now - start).count();
+  start = now;
+  return ms;
+}
+
+// Copy the counters of the last build() or update() of the cache
+void copyCacheStats(const TuftedLaplacianCache& cache, const SparseMatrix<double>& L, TuftedLaplacianStats& stats) {
+  stats.coverMs = cache.lastCoverMs;
+  stats.mollifyMs = cache.lastMollifyMs;
+  stats.flipMs = cache.lastFlipMs;
+  stats.matrixMs = cache.lastMatrixMs;
+  stats.nFlips = cache.lastNewFlips;
+  stats.nReplayedFlips = cache.lastReplayedFlips;
+  stats.rebuilt = cache.lastWasRebuild;
+  stats.laplacianNonzeros = L.nonZeros();
+}
+
+} // namespace
+
+std::string formatStatsLine(const TuftedLaplacianStats& stats) {
+  std::ostringstream out;
+  out << std::setprecision(6);
+  out << "tufted_stats {";
+  out << "\"load_ms\":" << stats.loadMs;
+  out << ",\"point_cloud_ms\":" << stats.pointCloudMs;
+  out << ",\"strip_triangulate_ms\":" << stats.stripTriangulateMs;
+  out << ",\"halfedge_ms\":" << stats.halfedgeMs;
+  out << ",\"tufted_ms\":" << stats.tuftedMs;
+  out << ",\"cover_ms\":" << stats.coverMs;
+  out << ",\"mollify_ms\":" << stats.mollifyMs;
+  out << ",\"flip_ms\":" << stats.flipMs;
+  out << ",\"matrix_ms\":" << stats.matrixMs;
+  out << ",\"reindex_ms\":" << stats.reindexMs;
+  out << ",\"output_ms\":" << stats.outputMs;
+  out << ",\"total_ms\":" << stats.totalMs;
+  out << ",\"point_cloud\":" << (stats.isPointCloud ? "true" : "false");
+  out << ",\"input_vertices\":" << stats.nInputVertices;
+  out << ",\"input_faces\":" << stats.nInputFaces;
+  out << ",\"vertices\":" << stats.nVertices;
+  out << ",\"faces\":" << stats.nFaces;
+  out << ",\"flips\":" << stats.nFlips;
+  out << ",\"laplacian_nnz\":" << stats.laplacianNonzeros;
+  out << ",\"avg_neighbors\":" << stats.avgNeighbors;
+  out << "}";
+  return out.str();
+}
+
 template <typename T>
 void saveMatrix(std::string filename, SparseMatrix<T>& matrix) {
 
@@ -60,20 +125,30 @@ void saveMatrix(std::string filename, SparseMatrix<T>& matrix) {
   outFile.close();
 }
 
-void processMesh(const std::string& inputFilename, float mollifyFactor, unsigned int nNeigh, double laplacianReplaceVal, double massReplaceVal, const std::string& outputPrefix, bool gui, bool writeLaplacian, bool writeMass) {
-  // Make sure a mesh name was given
-  if (inputFilename.empty()) {
-    return;
-  }
+// Build the Laplacian and mass matrices for an already-loaded mesh (or point cloud, if it has no faces). The matrices
+// are indexed like the input vertices.
+static void buildLaplacianForPolygons(SimplePolygonMesh& inputMesh, float mollifyFactor, unsigned int nNeigh,
+                                      bool adaptiveNeigh, unsigned int nNeighMin, double laplacianReplaceVal,
+                                      double massReplaceVal, SparseMatrix<double>& L, SparseMatrix<double>& M,
+                                      TuftedLaplacianStats& stats) {
+  Clock::time_point t = Clock::now();
 
-  // Load mesh
-  SimplePolygonMesh inputMesh(inputFilename);
+  stats.nInputVertices = inputMesh.nVertices();
+  stats.nInputFaces = inputMesh.nFaces();
 
   // if it's a point cloud, generate some triangles
   isPointCloud = inputMesh.polygons.empty();
+  stats.isPointCloud = isPointCloud;
   if (isPointCloud) {
     std::cout << "Detected point cloud input" << std::endl;
-    Neighbors_t neigh = generate_knn(inputMesh.vertexCoordinates, nNeigh);
+    Neighbors_t neigh;
+    if (adaptiveNeigh) {
+      neigh = generate_knn_adaptive(inputMesh.vertexCoordinates, nNeighMin, nNeigh, &stats.avgNeighbors);
+      std::cout << "Average neighborhood size: " << stats.avgNeighbors << std::endl;
+    } else {
+      neigh = generate_knn(inputMesh.vertexCoordinates, nNeigh);
+      stats.avgNeighbors = nNeigh;
+    }
     std::vector<Vector3> normals = generate_normals(inputMesh.vertexCoordinates, neigh);
     std::vector<std::vector<Vector2>> coords = generate_coords_projection(inputMesh.vertexCoordinates, normals, neigh);
     LocalTriangulationResult localTri = build_delaunay_triangulations(coords, neigh);
@@ -90,24 +165,30 @@ void processMesh(const std::string& inputFilename, float mollifyFactor, unsigned
       }
     }
   }
+  stats.pointCloudMs = lapMs(t);
 
   // make sure the input really is a triangle mesh
   inputMesh.stripFacesWithDuplicateVertices(); // need a richer format to encode these
   std::vector<size_t> oldToNewMap = inputMesh.stripUnusedVertices();
   inputMesh.triangulate(); // probably what the user wants
+  stats.stripTriangulateMs = lapMs(t);
 
   std::tie(mesh, geometry) = makeGeneralHalfedgeAndGeometry(inputMesh.polygons, inputMesh.vertexCoordinates);
+  stats.nVertices = mesh->nVertices();
+  stats.nFaces = mesh->nFaces();
+  stats.halfedgeMs = lapMs(t);
 
 
   // ta-da! (invoke the algorithm from geometry-central)
   std::cout << "Building tufted Laplacian..." << std::endl;
-  SparseMatrix<double> L, M;
   std::tie(L, M) = buildTuftedLaplacian(*mesh, *geometry, mollifyFactor);
   if (isPointCloud) {
     L = L / 3.;
     M = M / 3.;
   }
+  stats.tuftedMs = lapMs(t);
   std::cout << "  ...done!" << std::endl;
+  t = Clock::now();
 
   // If necessary, re-index matrices to account for any unreferenced vertices which were skipped.
   // For any unreferenced verts, creates an identity row/col in the Laplacian and
@@ -179,6 +260,47 @@ void processMesh(const std::string& inputFilename, float mollifyFactor, unsigned
       M.setFromTriplets(triplets.begin(), triplets.end());
     }
   }
+  stats.laplacianNonzeros = L.nonZeros();
+  stats.reindexMs = lapMs(t);
+}
+
+void processMesh(const std::string& inputFilename, float mollifyFactor, unsigned int nNeigh, bool adaptiveNeigh,
+                 unsigned int nNeighMin, double laplacianReplaceVal, double massReplaceVal,
+                 const std::string& outputPrefix, bool gui, bool writeLaplacian, bool writeMass,
+                 TuftedLaplacianStats* stats) {
+  // Make sure a mesh name was given
+  if (inputFilename.empty()) {
+    return;
+  }
+
+  TuftedLaplacianStats localStats;
+  TuftedLaplacianStats& thisStats = stats ? *stats : localStats;
+  Clock::time_point tStart = Clock::now();
+  Clock::time_point t = tStart;
+
+  // Load mesh, through the memory-mapped loader when the format allows it
+  SimplePolygonMesh inputMesh;
+  if (hasFastLoader(inputFilename)) {
+    FlatMesh flat = loadFlatMesh(inputFilename);
+    inputMesh.vertexCoordinates.resize(flat.nVertices());
+    for (size_t iV = 0; iV < flat.nVertices(); iV++) {
+      const double* xyz = &flat.vertexCoordinates[3 * iV];
+      inputMesh.vertexCoordinates[iV] = Vector3{xyz[0], xyz[1], xyz[2]};
+    }
+    inputMesh.polygons.resize(flat.nFaces());
+    for (size_t iF = 0; iF < flat.nFaces(); iF++) {
+      inputMesh.polygons[iF].assign(flat.faceIndices.begin() + flat.faceStarts[iF],
+                                    flat.faceIndices.begin() + flat.faceStarts[iF + 1]);
+    }
+  } else {
+    inputMesh.readMeshFromFile(inputFilename);
+  }
+  thisStats.loadMs = lapMs(t);
+
+  SparseMatrix<double> L, M;
+  buildLaplacianForPolygons(inputMesh, mollifyFactor, nNeigh, adaptiveNeigh, nNeighMin, laplacianReplaceVal,
+                            massReplaceVal, L, M, thisStats);
+  t = Clock::now();
 
   // write output matrices, if requested
   if (writeLaplacian) {
@@ -187,4 +309,110 @@ void processMesh(const std::string& inputFilename, float mollifyFactor, unsigned
   if (writeMass) {
     saveMatrix(outputPrefix + "lumped_mass.spmat", M);
   }
+  thisStats.outputMs = lapMs(t);
+  thisStats.totalMs = lapMs(tStart);
+
+  // machine-readable summary, one line
+  std::cout << formatStatsLine(thisStats) << std::endl;
+}
+
+TuftedLaplacianStats processMeshArrays(const std::vector<std::array<double, 3>>& positions,
+                                       const std::vector<std::array<size_t, 3>>& triangles, float mollifyFactor,
+                                       unsigned int nNeigh, bool adaptiveNeigh, unsigned int nNeighMin) {
+  TuftedLaplacianStats stats;
+  Clock::time_point tStart = Clock::now();
+  Clock::time_point t = tStart;
+
+  std::vector<Vector3> vertexCoordinates;
+  vertexCoordinates.reserve(positions.size());
+  for (const std::array<double, 3>& p : positions) {
+    vertexCoordinates.push_back(Vector3{p[0], p[1], p[2]});
+  }
+  std::vector<std::vector<size_t>> polygons;
+  polygons.reserve(triangles.size());
+  for (const std::array<size_t, 3>& tri : triangles) {
+    polygons.push_back({tri[0], tri[1], tri[2]});
+  }
+  SimplePolygonMesh inputMesh(polygons, vertexCoordinates);
+  stats.loadMs = lapMs(t);
+
+  SparseMatrix<double> L, M;
+  buildLaplacianForPolygons(inputMesh, mollifyFactor, nNeigh, adaptiveNeigh, nNeighMin, laplacianReplaceVal,
+                            massReplaceVal, L, M, stats);
+  stats.totalMs = lapMs(tStart);
+
+  return stats;
+}
+
+bool tuftedLaplacianBuild(const std::vector<std::array<double, 3>>& positions,
+                          const std::vector<std::array<size_t, 3>>& triangles, float mollifyFactor,
+                          TuftedLaplacianStats& stats) {
+  Clock::time_point tStart = Clock::now();
+  Clock::time_point t = tStart;
+  tuftedLaplacianCache.reset();
+  stats.nInputVertices = positions.size();
+  stats.nInputFaces = triangles.size();
+
+  // The cache keeps the vertex indexing of the input, so there is no re-indexing step to account for unused vertices
+  if (triangles.empty()) {
+    return false;
+  }
+  std::vector<bool> used(positions.size(), false);
+  std::vector<std::vector<size_t>> polygons;
+  polygons.reserve(triangles.size());
+  for (const std::array<size_t, 3>& tri : triangles) {
+    for (size_t iV : tri) {
+      if (iV >= positions.size()) return false;
+      used[iV] = true;
+    }
+    polygons.push_back({tri[0], tri[1], tri[2]});
+  }
+  if (std::find(used.begin(), used.end(), false) != used.end()) {
+    return false;
+  }
+  std::vector<Vector3> vertexCoordinates;
+  vertexCoordinates.reserve(positions.size());
+  for (const std::array<double, 3>& p : positions) {
+    vertexCoordinates.push_back(Vector3{p[0], p[1], p[2]});
+  }
+  stats.loadMs = lapMs(t);
+
+  std::tie(cachedMesh, cachedGeometry) = makeGeneralHalfedgeAndGeometry(polygons, vertexCoordinates);
+  stats.nVertices = cachedMesh->nVertices();
+  stats.nFaces = cachedMesh->nFaces();
+  stats.halfedgeMs = lapMs(t);
+
+  tuftedLaplacianCache.reset(new TuftedLaplacianCache());
+  tuftedLaplacianCache->mollifyFactor = mollifyFactor;
+  SparseMatrix<double> L, M;
+  std::tie(L, M) = tuftedLaplacianCache->build(*cachedMesh, *cachedGeometry);
+  stats.tuftedMs = lapMs(t);
+  copyCacheStats(*tuftedLaplacianCache, L, stats);
+  stats.totalMs = lapMs(tStart);
+  return true;
+}
+
+bool tuftedLaplacianUpdate(const std::vector<std::array<double, 3>>& positions, TuftedLaplacianStats& stats) {
+  if (!tuftedLaplacianCache || positions.size() != cachedMesh->nVertices()) {
+    return false;
+  }
+  Clock::time_point tStart = Clock::now();
+  Clock::time_point t = tStart;
+  stats.nInputVertices = positions.size();
+  stats.nVertices = cachedMesh->nVertices();
+  stats.nFaces = cachedMesh->nFaces();
+
+  std::vector<Vector3> vertexCoordinates;
+  vertexCoordinates.reserve(positions.size());
+  for (const std::array<double, 3>& p : positions) {
+    vertexCoordinates.push_back(Vector3{p[0], p[1], p[2]});
+  }
+  stats.loadMs = lapMs(t);
+
+  SparseMatrix<double> L, M;
+  std::tie(L, M) = tuftedLaplacianCache->update(vertexCoordinates);
+  stats.tuftedMs = lapMs(t);
+  copyCacheStats(*tuftedLaplacianCache, L, stats);
+  stats.totalMs = lapMs(tStart);
+  return true;
 }
@@ -0,0 +1,274 @@
+#include "tufted_laplacian_cache.h"
+
+#include "geometrycentral/surface/edge_length_geometry.h"
+#include "geometrycentral/surface/intrinsic_mollification.h"
+#include "geometrycentral/surface/tufted_laplacian.h"
+
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <unordered_map>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Milliseconds elapsed since `start`, and restart the measurement
+double lapMs(Clock::time_point& start) {
+  Clock::time_point now = Clock::now();
+  double ms = std::chrono::duration<double, std::milli>(now - start).count();
+  start = now;
+  return ms;
+}
+
+// Cotangent of the angle opposite `he` in its triangle, from edge lengths alone
+double oppositeCotan(Halfedge he, const EdgeData<double>& edgeLengths) {
+  double lA = edgeLengths[he.next().edge()];
+  double lB = edgeLengths[he.next().next().edge()];
+  double lC = edgeLengths[he.edge()];
+
+  double s = 0.5 * (lA + lB + lC);
+  double areaSq = s * (s - lA) * (s - lB) * (s - lC);
+  double area = std::sqrt(std::fmax(areaSq, 0.));
+  if (area <= 0.) return 0.; // degenerate, treat as a right angle so it never triggers a flip on its own
+
+  return (lA * lA + lB * lB - lC * lC) / (4. * area);
+}
+
+// An edge can only be flipped if it has exactly two incident interior halfedges
+bool isFlippable(Edge e) {
+  Halfedge he = e.halfedge();
+  Halfedge sib = he.sibling();
+  return he.isInterior() && sib != he && sib.isInterior() && sib.sibling() == he;
+}
+
+bool isDelaunay(Edge e, const EdgeData<double>& edgeLengths, double delaunayEPS) {
+  Halfedge he = e.halfedge();
+  double cotSum = oppositeCotan(he, edgeLengths) + oppositeCotan(he.sibling(), edgeLengths);
+  return cotSum >= -delaunayEPS;
+}
+
+uint64_t vertexPairKey(size_t a, size_t b) {
+  if (a > b) std::swap(a, b);
+  return (uint64_t(a) << 32) | uint64_t(b);
+}
+
+// Place the third corner of a triangle with base (0,0)-(lBase,0), at distance lA from the origin and lB from the far
+// end of the base. The result is in the upper half-plane.
+Vector2 layoutTriangleVertex(double lBase, double lA, double lB) {
+  double x = (lBase * lBase + lA * lA - lB * lB) / (2. * lBase);
+  double y = std::sqrt(std::fmax(lA * lA - x * x, 0.));
+  return Vector2{x, y};
+}
+
+} // namespace
+
+double flippedEdgeLength(Halfedge he, const EdgeData<double>& edgeLengths) {
+
+  // he points i --> j, in face (i, j, k)
+  Halfedge sib = he.sibling();
+  Vertex vI = he.vertex();
+  double lIJ = edgeLengths[he.edge()];
+  double lJK = edgeLengths[he.next().edge()];
+  double lKI = edgeLengths[he.next().next().edge()];
+
+  // the sibling may have either orientation in a general surface mesh
+  double lIL, lJL;
+  if (sib.vertex() == vI) { // i --> j, face (i, j, l)
+    lJL = edgeLengths[sib.next().edge()];
+    lIL = edgeLengths[sib.next().next().edge()];
+  } else { // j --> i, face (j, i, l)
+    lIL = edgeLengths[sib.next().edge()];
+    lJL = edgeLengths[sib.next().next().edge()];
+  }
+
+  if (!(lIJ > 0.)) return -1.;
+
+  // Lay out the quad with i at the origin and j along the x-axis, k above and l below
+  Vector2 pK = layoutTriangleVertex(lIJ, lKI, lJK);
+  Vector2 pL = layoutTriangleVertex(lIJ, lIL, lJL);
+  pL.y = -pL.y;
+
+  // The new diagonal must cross the interior of the old one
+  if (!(pK.y > 0.) || !(pL.y < 0.)) return -1.;
+  double t = pK.y / (pK.y - pL.y);
+  double xCross = pK.x + t * (pL.x - pK.x);
+  if (!(xCross > 0.) || !(xCross < lIJ)) return -1.;
+
+  return norm(pK - pL);
+}
+
+size_t flipToDelaunayRecorded(SurfaceMesh& mesh, EdgeData<double>& edgeLengths, std::vector<size_t>& flipLog,
+                              double delaunayEPS) {
+
+  std::deque<Edge> edgesToCheck;
+  EdgeData<char> inQueue(mesh, true);
+  for (Edge e : mesh.edges()) {
+    edgesToCheck.push_back(e);
+  }
+
+  size_t nFlips = 0;
+  while (!edgesToCheck.empty()) {
+    Edge e = edgesToCheck.front();
+    edgesToCheck.pop_front();
+    inQueue[e] = false;
+
+    if (!isFlippable(e) || isDelaunay(e, edgeLengths, delaunayEPS)) continue;
+
+    Halfedge he = e.halfedge();
+    double newLength = flippedEdgeLength(he, edgeLengths);
+    if (newLength < 0.) continue;
+
+    // Remember the quad before flipping, its sides are the ones which might stop being Delaunay
+    std::array<Edge, 4> quadEdges = {he.next().edge(), he.next().next().edge(), he.sibling().next().edge(),
+                                     he.sibling().next().next().edge()};
+
+    if (!mesh.flip(e, false)) continue;
+    edgeLengths[e] = newLength;
+    flipLog.push_back(e.getIndex());
+    nFlips++;
+
+    for (Edge qE : quadEdges) {
+      if (!inQueue[qE]) {
+        edgesToCheck.push_back(qE);
+        inQueue[qE] = true;
+      }
+    }
+  }
+
+  return nFlips;
+}
+
+std::tuple<SparseMatrix<double>, SparseMatrix<double>> TuftedLaplacianCache::build(SurfaceMesh& mesh,
+                                                                                   VertexPositionGeometry& geom) {
+  sourceMesh = &mesh;
+  Clock::time_point t = Clock::now();
+
+  // Same steps, in the same order, as buildTuftedLaplacian(): copy, mollify, cover, flip, matrices
+
+  // Create a copy of the mesh / geometry to operate on
+  std::unique_ptr<SurfaceMesh> tuftedMesh = mesh.copyToSurfaceMesh();
+  geom.requireVertexPositions();
+  VertexPositionGeometry tuftedGeom(*tuftedMesh, geom.vertexPositions.reinterpretTo(*tuftedMesh));
+  tuftedGeom.requireEdgeLengths();
+  EdgeData<double> tuftedEdgeLengths = tuftedGeom.edgeLengths;
+
+  // Mollify, if requested. This is done on the input mesh, before the cover is built.
+  if (mollifyFactor > 0) {
+    mollifyIntrinsic(*tuftedMesh, tuftedEdgeLengths, mollifyFactor);
+  }
+  lastMollifyMs = lapMs(t);
+
+  // Build the cover
+  buildIntrinsicTuftedCover(*tuftedMesh, tuftedEdgeLengths, &tuftedGeom);
+
+  // Every cover edge joins the same two vertices as an edge of the input mesh, which gives its length in update()
+  coverMesh = std::move(tuftedMesh);
+  std::unordered_map<uint64_t, size_t> sourceEdgeByVertices;
+  for (Edge e : mesh.edges()) {
+    sourceEdgeByVertices.emplace(vertexPairKey(e.firstVertex().getIndex(), e.secondVertex().getIndex()),
+                                 e.getIndex());
+  }
+  coverEdgeSource.clear();
+  coverEdgeSource.reserve(coverMesh->nEdges());
+  for (Edge e : coverMesh->edges()) {
+    auto it = sourceEdgeByVertices.find(vertexPairKey(e.firstVertex().getIndex(), e.secondVertex().getIndex()));
+    if (it == sourceEdgeByVertices.end()) {
+      throw std::runtime_error("TuftedLaplacianCache::build() cover edge has no matching input edge");
+    }
+    coverEdgeSource.push_back(it->second);
+  }
+  lastCoverMs = lapMs(t);
+
+  // Intrinsic triangulation starts as a copy of the cover
+  intrinsicMesh = coverMesh->copyToSurfaceMesh();
+  intrinsicEdgeLengths = tuftedEdgeLengths.reinterpretTo(*intrinsicMesh);
+
+  flipLog.clear();
+  size_t nFlips = flipToDelaunayRecorded(*intrinsicMesh, intrinsicEdgeLengths, flipLog, delaunayEPS);
+  flipLogBaseSize = flipLog.size();
+  lastFlipMs = lapMs(t);
+
+  lastWasRebuild = true;
+  lastReplayedFlips = 0;
+  lastNewFlips = nFlips;
+
+  return buildMatrices();
+}
+
+std::tuple<SparseMatrix<double>, SparseMatrix<double>>
+TuftedLaplacianCache::update(const std::vector<Vector3>& positions) {
+  if (!isBuilt()) {
+    throw std::runtime_error("TuftedLaplacianCache::update() called before build()");
+  }
+  if (positions.size() != coverMesh->nVertices()) {
+    throw std::runtime_error("TuftedLaplacianCache::update() vertex count does not match the cached mesh");
+  }
+
+  // Fall back to a full rebuild from the given positions
+  auto rebuild = [&]() {
+    VertexData<Vector3> newPositions(*sourceMesh);
+    for (Vertex v : sourceMesh->vertices()) {
+      newPositions[v] = positions[v.getIndex()];
+    }
+    VertexPositionGeometry newGeom(*sourceMesh, newPositions);
+    return build(*sourceMesh, newGeom);
+  };
+
+  if (flipLog.size() > maxFlipLogGrowth * std::fmax(flipLogBaseSize, 1.)) {
+    return rebuild();
+  }
+
+  // New lengths on the input mesh, mollified there as in build()
+  Clock::time_point t = Clock::now();
+  EdgeData<double> sourceEdgeLengths(*sourceMesh);
+  for (Edge e : sourceMesh->edges()) {
+    sourceEdgeLengths[e] = norm(positions[e.firstVertex().getIndex()] - positions[e.secondVertex().getIndex()]);
+  }
+  if (mollifyFactor > 0) {
+    mollifyIntrinsic(*sourceMesh, sourceEdgeLengths, mollifyFactor);
+  }
+  lastMollifyMs = lapMs(t);
+
+  // Reset to the cover, with the new lengths
+  intrinsicMesh = coverMesh->copyToSurfaceMesh();
+  intrinsicEdgeLengths = EdgeData<double>(*intrinsicMesh);
+  for (Edge e : intrinsicMesh->edges()) {
+    intrinsicEdgeLengths[e] = sourceEdgeLengths[sourceMesh->edge(coverEdgeSource[e.getIndex()])];
+  }
+  lastCoverMs = lapMs(t);
+
+  // Replay the flips which led to the previous Delaunay triangulation
+  for (size_t iE : flipLog) {
+    Edge e = intrinsicMesh->edge(iE);
+    double newLength = flippedEdgeLength(e.halfedge(), intrinsicEdgeLengths);
+    if (newLength < 0. || !intrinsicMesh->flip(e, false)) {
+      return rebuild();
+    }
+    intrinsicEdgeLengths[e] = newLength;
+  }
+
+  // Only the edges which moved out of the Delaunay condition get flipped now
+  size_t nFlips = flipToDelaunayRecorded(*intrinsicMesh, intrinsicEdgeLengths, flipLog, delaunayEPS);
+  lastFlipMs = lapMs(t);
+
+  lastWasRebuild = false;
+  lastReplayedFlips = flipLog.size() - nFlips;
+  lastNewFlips = nFlips;
+
+  return buildMatrices();
+}
+
+std::tuple<SparseMatrix<double>, SparseMatrix<double>> TuftedLaplacianCache::buildMatrices() {
+  Clock::time_point t = Clock::now();
+  EdgeLengthGeometry tuftedIntrinsicGeom(*intrinsicMesh, intrinsicEdgeLengths);
+  tuftedIntrinsicGeom.requireCotanLaplacian();
+  tuftedIntrinsicGeom.requireVertexLumpedMassMatrix();
+
+  // The cover double-counts every face
+  SparseMatrix<double> L = 0.5 * tuftedIntrinsicGeom.cotanLaplacian;
+  SparseMatrix<double> M = 0.5 * tuftedIntrinsicGeom.vertexLumpedMassMatrix;
+  lastMatrixMs = lapMs(t);
+
+  return std::make_tuple(L, M);
+}